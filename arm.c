@@ -72,6 +72,7 @@ void i_done(void)
 		out_sym("__moddi3", OUT_CS, cslen, 0);
 		os(moddi3, sizeof(moddi3));
 	}
+	putdiv = 0;
 }
 
 /* for optimizing cmp + bcc */
@@ -0,0 +1,118 @@
+#!/bin/sh
+# neatcc benchmarks: ./bench.sh [ncc]
+#
+# Each benchmark generates its input in a temporary directory, compiles
+# it with "ncc -s" and prints the statistics relevant to it.
+NCC="${1-./ncc}"
+DIR="$(mktemp -d)"
+trap 'rm -rf "$DIR"' EXIT
+
+# tokens read per second: 20000 small functions (2.5MB); the time
+# includes parsing and code generation
+bench_lex() {
+	awk 'BEGIN {
+		for (i = 0; i < 20000; i++) {
+			printf "int f%d(int a, int b)\n{\n", i
+			printf "\tint s = a * %d + (b >> 2);\n", i
+			printf "\tif (s > 0x7fff && a != b)\n\t\ts -= a <= b ? a : b;\n"
+			printf "\treturn s ^ %d;\n}\n\n", i * 7
+		}
+	}' > "$DIR/lex.c"
+	echo "lex: $(wc -c < "$DIR/lex.c") bytes"
+	"$NCC" -s -o "$DIR/lex.o" "$DIR/lex.c" 2>&1 | grep '^tokens:'
+}
+
+# mapped and copied input: 200 headers of 64KB each, included twice
+bench_map() {
+	mkdir -p "$DIR/inc"
+	for i in $(seq 200); do
+		awk -v n=$i 'BEGIN {
+			printf "#ifndef H%d\n#define H%d\n", n, n
+			for (i = 0; i < 2000; i++)
+				printf "extern int h%d_%d(int a, int b);\n", n, i
+			printf "#endif\n"
+		}' > "$DIR/inc/h$i.h"
+		echo "#include \"h$i.h\"" >> "$DIR/map.c"
+		echo "#include \"h$i.h\"" >> "$DIR/map.c"
+	done
+	echo "map: $(cat "$DIR"/inc/*.h | wc -c) bytes in headers"
+	"$NCC" -s -I"$DIR/inc" -o "$DIR/map.o" "$DIR/map.c" 2>&1 | grep -e '^files:' -e '^includes:'
+}
+
+# macro lookups: 50000 macros, each expanded twice in 500 functions
+bench_macro() {
+	awk 'BEGIN {
+		for (i = 0; i < 50000; i++)
+			printf "#define M%d(a)\t((a) + %d)\n", i, i
+		for (i = 0; i < 50000; i++) {
+			if (i % 100 == 0)
+				printf "int f%d(int s)\n{\n", i
+			printf "\ts += M%d(M%d(s));\n", i, (i * 7) % 50000
+			if (i % 100 == 99)
+				printf "\treturn s;\n}\n"
+		}
+	}' > "$DIR/macro.c"
+	echo "macro: 50000 macros"
+	"$NCC" -s -o "$DIR/macro.o" "$DIR/macro.c" 2>&1 | grep -e '^macros:' -e '^tokens:'
+}
+
+# skipping comments and conditionals: 4MB in comments and 2MB in #if 0
+bench_skip() {
+	awk 'BEGIN {
+		for (i = 0; i < 20000; i++)
+			printf "/* comment %d: %s */\n", i, sprintf("%80s", "")
+		for (i = 0; i < 20000; i++)
+			printf "// comment %d: %s\n", i, sprintf("%80s", "")
+		printf "#if 0\n"
+		for (i = 0; i < 40000; i++)
+			printf "int g%d(int a) { return a + \"%d\"[0]; }  /* %d */\n", i, i, i
+		printf "#endif\n"
+		printf "int main(void)\n{\n\treturn 0;\n}\n"
+	}' > "$DIR/skip.c"
+	echo "skip: $(wc -c < "$DIR/skip.c") bytes"
+	"$NCC" -s -o "$DIR/skip.o" "$DIR/skip.c" 2>&1 | grep -e '^skipped:' -e '^tokens:'
+}
+
+# single-pass compilation: 1000 functions with loops, branches and
+# locals, compiled with and without -O0; the times are those of the
+# whole compilation
+bench_o0() {
+	awk 'BEGIN {
+		for (i = 0; i < 1000; i++) {
+			printf "int f%d(int *a, int n)\n{\n", i
+			printf "\tint i, s = %d, t = 0;\n", i
+			printf "\tfor (i = 0; i < n; i++) {\n"
+			printf "\t\tif (a[i] > s)\n\t\t\tt += a[i] - s;\n"
+			printf "\t\telse\n\t\t\ts ^= a[i] << %d;\n\t}\n", i % 7
+			printf "\treturn s + t * %d;\n}\n\n", i
+		}
+	}' > "$DIR/o0.c"
+	echo "o0: $(wc -c < "$DIR/o0.c") bytes"
+	for o in "" -O0; do
+		"$NCC" -s $o -o "$DIR/o0.o" "$DIR/o0.c" 2>&1 |
+			sed -n "s/^tokens: .* in \([0-9]*us\).*/${o:-default}: \1/p"
+		echo "${o:-default}: $(wc -c < "$DIR/o0.o") bytes of object"
+	done
+}
+
+# code generation: 3000 functions of straight-line arithmetic
+bench_code() {
+	awk 'BEGIN {
+		for (i = 0; i < 3000; i++) {
+			printf "int g%d(int a, int b, int c)\n{\n", i
+			printf "\tint x = a * %d + b;\n\tint y = (b - c) >> 3;\n", i
+			printf "\tx = x * y + (a & c) - (x | %d);\n", i
+			printf "\ty = y ^ x + a %% (c | 1);\n"
+			printf "\treturn x - y + c * b;\n}\n\n"
+		}
+	}' > "$DIR/code.c"
+	echo "code: $(wc -c < "$DIR/code.c") bytes"
+	"$NCC" -s -o "$DIR/code.o" "$DIR/code.c" 2>&1 | grep '^code:'
+}
+
+bench_lex
+bench_map
+bench_macro
+bench_skip
+bench_o0
+bench_code
@@ -1,16 +1,24 @@
 /* neatcc preprocessor */
 #include <ctype.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 #include "mem.h"
 #include "ncc.h"
+#include "tab.h"
 #include "tok.h"
 
 static char *buf;
@@ -19,15 +27,21 @@ static int cur;
 
 static struct macro {
 	char name[NAMELEN];	/* macro name */
-	char def[MDEFLEN];	/* macro definition */
-	char args[NARGS][NAMELEN];
+	char *def;		/* macro definition */
+	char *args;		/* argument names; NAMELEN bytes each */
 	int nargs;		/* number of arguments */
+	int *slots;		/* offset and index of arguments used in def */
+	int nslots;		/* number of argument uses in def */
 	int isfunc;		/* macro is a function */
 	int undef;		/* macro is removed */
-} macros[NDEFS];
-static int mcount = 1;		/* number of macros */
-static int mhead[256];		/* macro hash table heads */
-static int mnext[NDEFS];	/* macro hash table next entries */
+} **macros;
+static int mcount;		/* number of macros */
+static int msize;		/* size of macros[] */
+static struct tab mtab;		/* macro hash table */
+static long stat_finds;		/* macro lookups */
+static long stat_cmps;		/* macro names compared in lookups */
+static long stat_cmtskip;	/* bytes skipped in comments */
+static long stat_ifskip;	/* bytes skipped in inactive conditionals */
 
 #define BUF_FILE		0
 #define BUF_MACRO		1
@@ -43,15 +57,22 @@ static struct buf {
 	int type;
 	/* for BUF_FILE */
 	char path[NAMELEN];
+	int inc;			/* the incs[] index of the file */
+	int lpos;			/* buf_line() has counted lines before lpos */
+	int line;			/* the line at lpos */
 	/* for BUF_MACRO */
 	struct macro *macro;
-	char args[NARGS][MARGLEN];	/* arguments passed to a macro */
+	char *args[NARGS];		/* arguments passed to a macro */
+	int argslen[NARGS];		/* the length of arguments */
+	int slot;			/* the next macro->slots entry */
 	/* for BUF_ARG */
 	int arg_buf;			/* the bufs index of the owning macro */
 } bufs[NBUFS];
 static int nbufs;
 static int bufs_limit = 1;		/* cpp_read() limit; useful in cpp_eval() */
 
+void (*die_hook)(char *msg);		/* if set, called instead of exiting */
+
 void die(char *fmt, ...)
 {
 	va_list ap;
@@ -59,6 +80,8 @@ void die(char *fmt, ...)
 	va_start(ap, fmt);
 	vsprintf(msg, fmt, ap);
 	va_end(ap);
+	if (die_hook)
+		die_hook(msg);
 	write(2, msg, strlen(msg));
 	exit(1);
 }
@@ -77,6 +100,8 @@ static void buf_new(int type, char *dat, int dlen)
 	buf = dat;
 	len = dlen;
 	bufs[nbufs - 1].type = type;
+	bufs[nbufs - 1].lpos = 0;
+	bufs[nbufs - 1].line = 1;
 }
 
 static void buf_file(char *path, char *dat, int dlen)
@@ -89,11 +114,13 @@ static void buf_macro(struct macro *m)
 {
 	buf_new(BUF_MACRO, m->def, strlen(m->def));
 	bufs[nbufs - 1].macro = m;
+	bufs[nbufs - 1].slot = 0;
 }
 
-static void buf_arg(char *arg, int mbuf)
+/* arguments are read from the text of the buffer that calls the macro */
+static void buf_arg(char *arg, int alen, int mbuf)
 {
-	buf_new(BUF_ARG, arg, strlen(arg));
+	buf_new(BUF_ARG, arg, alen);
 	bufs[nbufs - 1].arg_buf = mbuf;
 }
 
@@ -116,35 +143,51 @@ static int buf_iseval(void)
 	return 0;
 }
 
-static size_t file_size(int fd)
-{
-	struct stat st;
-	if (!fstat(fd, &st))
-		return st.st_size;
-	return 0;
-}
-
-static int include_file(char *path)
+/* the offset of the first byte of set (at most 8 bytes) in s[0..n) or n */
+static int scan(char *s, int n, char *set)
 {
-	int fd = open(path, O_RDONLY);
-	int n = 0, nr = 0;
-	char *dat;
-	int size;
-	if (fd == -1)
-		return -1;
-	size = file_size(fd) + 1;
-	dat = malloc(size);
-	while ((n = read(fd, dat + nr, size - nr)) > 0)
-		nr += n;
-	close(fd);
-	dat[nr] = '\0';
-	buf_file(path, dat, nr);
-	return 0;
+	int nset = strlen(set);
+	int i = 0, j;
+#ifdef __AVX2__
+	__m256i c32[8];
+	for (j = 0; j < nset; j++)
+		c32[j] = _mm256_set1_epi8(set[j]);
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((void *) (s + i));
+		__m256i m = _mm256_cmpeq_epi8(v, c32[0]);
+		unsigned mask;
+		for (j = 1; j < nset; j++)
+			m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, c32[j]));
+		if ((mask = _mm256_movemask_epi8(m)))
+			return i + __builtin_ctz(mask);
+	}
+#endif
+#ifdef __SSE2__
+	__m128i c16[8];
+	for (j = 0; j < nset; j++)
+		c16[j] = _mm_set1_epi8(set[j]);
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((void *) (s + i));
+		__m128i m = _mm_cmpeq_epi8(v, c16[0]);
+		unsigned mask;
+		for (j = 1; j < nset; j++)
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(v, c16[j]));
+		if ((mask = _mm_movemask_epi8(m)))
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < n; i++)
+		for (j = 0; j < nset; j++)
+			if (s[i] == set[j])
+				return i;
+	return i;
 }
 
-int cpp_init(char *path)
+/* move cur to the first byte of set or len, skipping backslash escapes */
+static void jumpesc(char *set)
 {
-	return include_file(path);
+	while ((cur += scan(buf + cur, len - cur, set)) < len && buf[cur] == '\\')
+		cur += 2;
 }
 
 static int jumpws(void)
@@ -165,18 +208,22 @@ static void read_word(char *dst)
 
 static int jumpcomment(void)
 {
+	int beg = cur;
 	if (buf[cur] == '/' && buf[cur + 1] == '*') {
-		while (++cur < len) {
-			if (buf[cur] == '*' && buf[cur + 1] == '/') {
+		cur++;
+		while ((cur += scan(buf + cur, len - cur, "*")) < len) {
+			if (buf[cur + 1] == '/') {
 				cur += 2;
+				stat_cmtskip += cur - beg;
 				return 0;
 			}
+			cur++;
 		}
 	}
 	if (buf[cur] == '/' && buf[cur + 1] == '/') {
-		while (++cur < len && buf[cur] != '\n')
-			if (buf[cur] == '\\')
-				cur++;
+		cur++;
+		jumpesc("\n\\");
+		stat_cmtskip += cur - beg;
 		return 0;
 	}
 	return 1;
@@ -185,16 +232,14 @@ static int jumpcomment(void)
 static int jumpstr(void)
 {
 	if (buf[cur] == '\'') {
-		while (++cur < len && buf[cur] != '\'')
-			if (buf[cur] == '\\')
-				cur++;
+		cur++;
+		jumpesc("'\\");
 		cur++;
 		return 0;
 	}
 	if (buf[cur] == '"') {
-		while (++cur < len && buf[cur] != '"')
-			if (buf[cur] == '\\')
-				cur++;
+		cur++;
+		jumpesc("\"\\");
 		cur++;
 		return 0;
 	}
@@ -207,6 +252,13 @@ static void read_tilleol(char *dst)
 		cur++;
 	while (cur < len && buf[cur] != '\n') {
 		int last = cur;
+		int n = scan(buf + cur, len - cur, "\n\\\"'/");
+		if (n) {
+			memcpy(dst, buf + cur, n);
+			dst += n;
+			cur += n;
+			continue;
+		}
 		if (buf[cur] == '\\' && buf[cur + 1] == '\n') {
 			cur += 2;
 			continue;
@@ -231,21 +283,6 @@ void cpp_addpath(char *s)
 	locs[nlocs++] = s;
 }
 
-static int include_find(char *name, int std)
-{
-	int i;
-	for (i = std ? nlocs - 1 : nlocs; i >= 0; i--) {
-		char path[1 << 10];
-		if (locs[i])
-			sprintf(path, "%s/%s", locs[i], name);
-		else
-			strcpy(path, name);
-		if (!include_file(path))
-			return 0;
-	}
-	return -1;
-}
-
 static void readarg(char *s)
 {
 	int depth = 0;
@@ -275,13 +312,12 @@ static void readarg(char *s)
 /* find a macro; if undef is nonzero, search #undef-ed macros too */
 static int macro_find(char *name, int undef)
 {
-	int i = mhead[(unsigned char) name[0]];
-	while (i > 0) {
-		if (!strcmp(name, macros[i].name))
-			if (!macros[i].undef || undef)
+	int i;
+	stat_finds++;
+	for (i = tab_find(&mtab, name); i >= 0; i = tab_next(&mtab, i))
+		if (++stat_cmps && !strcmp(name, macros[i]->name))
+			if (!macros[i]->undef || undef)
 				return i;
-		i = mnext[i];
-	}
 	return -1;
 }
 
@@ -289,7 +325,7 @@ static void macro_undef(char *name)
 {
 	int i = macro_find(name, 0);
 	if (i >= 0)
-		macros[i].undef = 1;
+		macros[i]->undef = 1;
 }
 
 static int macro_new(char *name)
@@ -297,28 +333,108 @@ static int macro_new(char *name)
 	int i = macro_find(name, 1);
 	if (i >= 0)
 		return i;
-	if (mcount >= NDEFS)
-		die("nomem: NDEFS reached!\n");
+	if (mcount == msize) {
+		msize = msize ? msize * 2 : 1024;
+		macros = realloc(macros, msize * sizeof(macros[0]));
+	}
 	i = mcount++;
-	strcpy(macros[i].name, name);
-	mnext[i] = mhead[(unsigned char) name[0]];
-	mhead[(unsigned char) name[0]] = i;
+	macros[i] = calloc(1, sizeof(*macros[i]));
+	strcpy(macros[i]->name, name);
+	tab_add(&mtab, name);
 	return i;
 }
 
+/* free all macros */
+static void macro_freeall(void)
+{
+	int i;
+	for (i = 0; i < mcount; i++) {
+		free(macros[i]->def);
+		free(macros[i]->args);
+		free(macros[i]->slots);
+		free(macros[i]);
+	}
+	mcount = 0;
+}
+
+static int macro_arg(struct macro *m, char *arg)
+{
+	int i;
+	for (i = 0; i < m->nargs; i++)
+		if (!strcmp(arg, m->args + i * NAMELEN))
+			return i;
+	return -1;
+}
+
+/* find the uses of macro arguments in its definition */
+static void macro_slots(struct macro *d)
+{
+	char *s = d->def;
+	int n = 0;
+	while (*s) {
+		if (*s == '"' || *s == '\'') {
+			int c = *s;
+			while (*++s && *s != c)
+				if (*s == '\\' && s[1])
+					s++;
+			if (*s)
+				s++;
+			continue;
+		}
+		if (isalnum((unsigned char) *s) || *s == '_') {
+			char word[NAMELEN];
+			char *w = word;
+			int arg;
+			char *beg = s;
+			while (isalnum((unsigned char) *s) || *s == '_')
+				*w++ = *s++;
+			*w = '\0';
+			if ((arg = macro_arg(d, word)) >= 0) {
+				if (!(n & 15))
+					d->slots = realloc(d->slots, (n + 16) * 2 * sizeof(int));
+				d->slots[n * 2] = beg - d->def;
+				d->slots[n * 2 + 1] = arg;
+				n++;
+			}
+			continue;
+		}
+		s++;
+	}
+	d->nslots = n;
+}
+
+/* set the definition and the arguments of a macro */
+static void macro_set(struct macro *d, char *def, char args[][NAMELEN], int nargs)
+{
+	free(d->def);
+	free(d->args);
+	free(d->slots);
+	d->def = malloc(strlen(def) + 1);
+	strcpy(d->def, def);
+	d->args = nargs ? malloc(nargs * NAMELEN) : NULL;
+	memcpy(d->args, args, nargs * NAMELEN);
+	d->nargs = nargs;
+	d->slots = NULL;
+	macro_slots(d);
+}
+
 static void macro_define(void)
 {
 	char name[NAMELEN];
+	char def[MDEFLEN];
+	char args[NARGS][NAMELEN];
+	int nargs = 0;
 	struct macro *d;
+	int i;
 	read_word(name);
-	d = &macros[macro_new(name)];
+	i = macro_new(name);
+	d = macros[i];
 	d->isfunc = 0;
-	d->nargs = 0;
 	if (buf[cur] == '(') {
 		cur++;
 		jumpws();
 		while (cur < len && buf[cur] != ')') {
-			readarg(d->args[d->nargs++]);
+			readarg(args[nargs++]);
 			jumpws();
 			if (buf[cur] != ',')
 				break;
@@ -328,7 +444,551 @@ static void macro_define(void)
 		cur++;
 		d->isfunc = 1;
 	}
-	read_tilleol(d->def);
+	read_tilleol(def);
+	macro_set(d, def, args, nargs);
+}
+
+/*
+ * included files; guarded and #pragma once files are not read again
+ *
+ * The contents of the files are kept until cpp_done(), so that the
+ * translation units after a cpp_reset() can include them again
+ * without reading them.  After cpp_renew(), they are checked with
+ * stat() before their next use.
+ */
+static struct inc {
+	char *path;		/* the path of the file when first included */
+	dev_t dev;
+	ino_t ino;
+	char guard[NAMELEN];	/* the #ifndef guard around the whole file */
+	int once;		/* the file contains #pragma once */
+	int tu;			/* the translation unit that included it last */
+	char *dat;		/* file contents or NULL */
+	int len;		/* the length of dat */
+	long mlen;		/* mmap() length of dat or zero */
+	long size;		/* file size when read */
+	long mtime;		/* file modification time when read */
+	long rtime;		/* the time the file was read */
+	int gen;		/* the cpp_renew() call that last checked it */
+} *incs;
+static int nincs;
+static int szincs;
+static struct tab inctab;	/* incs[] path hash table */
+static int tu;			/* the current translation unit */
+static int gen;			/* the number of cpp_renew() calls */
+
+static int inc_find(char *path)
+{
+	int i;
+	for (i = tab_find(&inctab, path); i >= 0; i = tab_next(&inctab, i))
+		if (!strcmp(path, incs[i].path))
+			return i;
+	return -1;
+}
+
+/* find a file included via another path */
+static int inc_ino(struct stat *st)
+{
+	int i;
+	for (i = 0; i < nincs; i++)
+		if (incs[i].dev == st->st_dev && incs[i].ino == st->st_ino)
+			return i;
+	return -1;
+}
+
+static int inc_add(char *path, struct stat *st)
+{
+	int i;
+	if (nincs == szincs) {
+		szincs = szincs ? szincs * 2 : 512;
+		incs = realloc(incs, szincs * sizeof(incs[0]));
+		memset(incs + nincs, 0, (szincs - nincs) * sizeof(incs[0]));
+	}
+	i = nincs++;
+	incs[i].path = malloc(strlen(path) + 1);
+	strcpy(incs[i].path, path);
+	incs[i].dev = st->st_dev;
+	incs[i].ino = st->st_ino;
+	incs[i].gen = gen;
+	tab_add(&inctab, path);
+	return i;
+}
+
+/* forget the contents of incs[i] */
+static void inc_drop(int i)
+{
+	if (incs[i].mlen)
+		munmap(incs[i].dat, incs[i].mlen);
+	else
+		free(incs[i].dat);
+	incs[i].dat = NULL;
+	incs[i].mlen = 0;
+}
+
+/*
+ * drop the contents and guard of incs[i] if the file has changed;
+ * like git's index, a file modified in the second it was read is
+ * assumed to have changed, since its mtime cannot tell
+ */
+static void inc_check(int i)
+{
+	struct inc *inc = &incs[i];
+	struct stat st;
+	inc->gen = gen;
+	if (!stat(inc->path, &st) && st.st_dev == inc->dev &&
+			st.st_ino == inc->ino && st.st_size == inc->size &&
+			st.st_mtime == inc->mtime && st.st_mtime < inc->rtime)
+		return;
+	inc_drop(i);
+	inc->guard[0] = '\0';
+	inc->once = 0;
+}
+
+/* including the file has no effect */
+static int inc_skip(int i)
+{
+	return (incs[i].once && incs[i].tu == tu) ||
+		(incs[i].guard[0] && macro_find(incs[i].guard, 0) >= 0);
+}
+
+/* detect #ifndef X ... #endif covering the whole of the current buffer */
+static void inc_guard(char *guard)
+{
+	char cmd[NAMELEN];
+	char name[NAMELEN];
+	int depth = 0;
+	while (cur < len && (!jumpws() || !jumpcomment()))
+		;
+	if (buf[cur] != '#')
+		return;
+	cur++;
+	read_word(cmd);
+	if (strcmp("ifndef", cmd))
+		return;
+	read_word(name);
+	while ((cur += scan(buf + cur, len - cur, "#/\"'")) < len) {
+		if (buf[cur] == '#') {
+			cur++;
+			read_word(cmd);
+			if (!strcmp("endif", cmd) && !depth)
+				break;
+			if (!strcmp("endif", cmd))
+				depth--;
+			if (!depth && (!strcmp("else", cmd) || !strcmp("elif", cmd)))
+				return;
+			if (!strcmp("ifdef", cmd) || !strcmp("ifndef", cmd) ||
+					!strcmp("if", cmd))
+				depth++;
+			continue;
+		}
+		if (!jumpcomment())
+			continue;
+		if (!jumpstr())
+			continue;
+		cur++;
+	}
+	if (cur >= len)
+		return;
+	while (cur < len && (!jumpws() || !jumpcomment()))
+		;
+	if (cur >= len)
+		strcpy(guard, name);
+}
+
+/* map a regular file; the bytes after its end are zero */
+static char *file_map(int fd, long size, long *mlen)
+{
+	long pg = sysconf(_SC_PAGESIZE);
+	char *dat;
+	*mlen = (size + pg) & ~(pg - 1);
+	/* the zero-filled tail of the last page terminates the buffer */
+	if (size % pg) {
+		dat = mmap(NULL, *mlen, PROT_READ, MAP_PRIVATE, fd, 0);
+		return dat != MAP_FAILED ? dat : NULL;
+	}
+	/* an anonymous page follows the file */
+	dat = mmap(NULL, *mlen, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (dat == MAP_FAILED)
+		return NULL;
+	if (mmap(dat, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(dat, *mlen);
+		return NULL;
+	}
+	return dat;
+}
+
+/* read a file or a pipe into a null-terminated buffer */
+static char *file_read(int fd, long size, int *len)
+{
+	int sz = size + 1 > 1024 ? size + 1 : 1024;
+	char *dat = malloc(sz);
+	int n = 0, nr = 0;
+	while ((n = read(fd, dat + nr, sz - nr - 1)) > 0) {
+		nr += n;
+		if (nr + 1 == sz) {
+			sz += sz;
+			dat = realloc(dat, sz);
+		}
+	}
+	dat[nr] = '\0';
+	*len = nr;
+	return dat;
+}
+
+static int stat_hits;		/* includes resolved via the cache */
+static int stat_misses;		/* includes searched in locs[] */
+static int stat_opens;		/* open() calls for included files */
+static int stat_skips;		/* paths skipped using directory listings */
+static int stat_reuses;		/* included files not read again */
+static int stat_maps;		/* files mapped */
+static long stat_mapped;	/* bytes mapped */
+static int stat_reads;		/* files read */
+static long stat_copied;	/* bytes read */
+
+/* push the contents of incs[inc] as file path */
+static void include_dat(char *path, int inc)
+{
+	buf_file(path, incs[inc].dat, incs[inc].len);
+	bufs[nbufs - 1].inc = inc;
+	incs[inc].tu = tu;
+}
+
+/* include the given file; returns its incs[] index or -1 */
+static int include_file(char *path)
+{
+	int inc = inc_find(path);
+	struct stat st;
+	char *dat = NULL;
+	long mlen = 0;
+	int nr = 0;
+	int fd;
+	if (inc >= 0 && incs[inc].dat && incs[inc].gen != gen)
+		inc_check(inc);
+	if (inc >= 0 && inc_skip(inc))
+		return inc;
+	if (inc >= 0 && incs[inc].dat) {
+		stat_reuses++;
+		include_dat(path, inc);
+		return inc;
+	}
+	stat_opens++;
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st))
+		memset(&st, 0, sizeof(st));
+	if (inc < 0 && (inc = inc_ino(&st)) >= 0 && incs[inc].dat &&
+			incs[inc].gen != gen)
+		inc_check(inc);
+	if (inc >= 0 && inc_skip(inc)) {
+		close(fd);
+		return inc;
+	}
+	if (inc >= 0 && incs[inc].dat) {
+		close(fd);
+		stat_reuses++;
+		include_dat(path, inc);
+		return inc;
+	}
+	if (inc < 0)
+		inc = inc_add(path, &st);
+	incs[inc].dev = st.st_dev;
+	incs[inc].ino = st.st_ino;
+	incs[inc].size = st.st_size;
+	incs[inc].mtime = st.st_mtime;
+	incs[inc].rtime = time(NULL);
+	if (S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size < (1 << 30))
+		dat = file_map(fd, st.st_size, &mlen);
+	if (dat) {
+		nr = st.st_size;
+		stat_maps++;
+		stat_mapped += nr;
+	} else {
+		mlen = 0;
+		dat = file_read(fd, st.st_size, &nr);
+		stat_reads++;
+		stat_copied += nr;
+	}
+	close(fd);
+	incs[inc].dat = dat;
+	incs[inc].len = nr;
+	incs[inc].mlen = mlen;
+	include_dat(path, inc);
+	if (!incs[inc].guard[0]) {
+		long cmt = stat_cmtskip;
+		inc_guard(incs[inc].guard);
+		stat_cmtskip = cmt;
+		cur = 0;
+	}
+	return inc;
+}
+
+int cpp_init(char *path)
+{
+	return include_file(path) < 0 ? -1 : 0;
+}
+
+/* preprocess the dlen bytes at dat as the contents of file path */
+int cpp_initbuf(char *path, char *dat, int dlen)
+{
+	struct stat st;
+	char *s = malloc(dlen + 1);
+	int inc;
+	memcpy(s, dat, dlen);
+	s[dlen] = '\0';
+	memset(&st, 0, sizeof(st));
+	inc = inc_add(path, &st);
+	incs[inc].dat = s;
+	incs[inc].len = dlen;
+	include_dat(path, inc);
+	return 0;
+}
+
+/* the names in search directories; for avoiding failed open() calls */
+static struct dir {
+	int state;		/* 0: not read, 1: read, 2: unreadable */
+	struct tab tab;		/* names hash table */
+	struct mem offs;	/* the offset of names in dat */
+	struct mem dat;		/* names */
+	long mtime;		/* directory modification time when read */
+	long rtime;		/* the time the directory was read */
+} dirs[NLOCS + 1];
+
+static void dir_read(struct dir *d, char *path)
+{
+	DIR *dir = opendir(path);
+	struct dirent *de;
+	struct stat st;
+	d->state = dir ? 1 : 2;
+	if (!dir)
+		return;
+	d->mtime = stat(path, &st) ? 0 : st.st_mtime;
+	d->rtime = time(NULL);
+	while ((de = readdir(dir))) {
+		int off = mem_len(&d->dat);
+		mem_put(&d->dat, de->d_name, strlen(de->d_name) + 1);
+		mem_put(&d->offs, &off, sizeof(off));
+		tab_add(&d->tab, de->d_name);
+	}
+	closedir(dir);
+}
+
+/* return zero if the first component of name is not in locs[i] */
+static int dir_has(int i, char *name)
+{
+	struct dir *d = &dirs[i];
+	char comp[NAMELEN];
+	char *slash = strchr(name, '/');
+	int n = slash ? slash - name : strlen(name);
+	int *offs;
+	char *dat;
+	int j;
+	if (!d->state)
+		dir_read(d, locs[i] ? locs[i] : ".");
+	if (d->state != 1 || n >= sizeof(comp) || name[0] == '/')
+		return 1;
+	memcpy(comp, name, n);
+	comp[n] = '\0';
+	offs = mem_buf(&d->offs);
+	dat = mem_buf(&d->dat);
+	for (j = tab_find(&d->tab, comp); j >= 0; j = tab_next(&d->tab, j))
+		if (!strcmp(comp, dat + offs[j]))
+			return 1;
+	return 0;
+}
+
+/* resolved #include names: "<name" or "\"name" to incs[] index */
+static struct tab rtab;
+static struct mem rkeys;	/* the offset of keys in rdat */
+static struct mem rincs;	/* incs[] index of each key */
+static struct mem rlocs;	/* locs[] index of each key */
+static struct mem rgens;	/* the cpp_renew() call that last checked it */
+static struct mem rdat;		/* keys */
+
+static void rtab_free(void)
+{
+	tab_done(&rtab);
+	mem_done(&rkeys);
+	mem_done(&rincs);
+	mem_done(&rlocs);
+	mem_done(&rgens);
+	mem_done(&rdat);
+}
+
+static void dir_free(struct dir *d)
+{
+	tab_done(&d->tab);
+	mem_done(&d->offs);
+	mem_done(&d->dat);
+	d->state = 0;
+}
+
+static char rcwd[1 << 10];	/* the working directory given to cpp_renew() */
+static struct mem rpath;	/* rcwd and locs[] of the cached listings */
+static int rgen;		/* the cpp_renew() call that checked them */
+
+/* drop listings and resolved names made stale by cpp_renew() */
+static void dirs_check(void)
+{
+	struct mem key;
+	struct stat st;
+	int stale = 0;
+	int i;
+	rgen = gen;
+	mem_init(&key);
+	mem_put(&key, rcwd, strlen(rcwd) + 1);
+	for (i = 0; i < nlocs; i++)
+		mem_put(&key, locs[i], strlen(locs[i]) + 1);
+	if (mem_len(&key) != mem_len(&rpath) ||
+			memcmp(mem_buf(&key), mem_buf(&rpath), mem_len(&key))) {
+		for (i = 0; i <= NLOCS; i++)
+			dir_free(&dirs[i]);
+		mem_done(&rpath);
+		rpath = key;
+		stale = 1;
+	} else {
+		mem_done(&key);
+	}
+	for (i = 0; i <= nlocs; i++) {
+		struct dir *d = &dirs[i];
+		if (d->state == 1 && (stat(locs[i] ? locs[i] : ".", &st) ||
+				st.st_mtime != d->mtime || d->mtime >= d->rtime)) {
+			dir_free(d);
+			stale = 1;
+		}
+	}
+	if (stale)
+		rtab_free();
+}
+
+/* the path of name in locs[i] */
+static void inc_path(char *path, int i, char *name)
+{
+	if (locs[i])
+		sprintf(path, "%s/%s", locs[i], name);
+	else
+		strcpy(path, name);
+}
+
+/*
+ * check that no search directory before locs[loc] has name; creating
+ * dir/sub/name changes the mtime of dir/sub but not that of dir, which
+ * is all dirs_check() looks at
+ */
+static int include_valid(char *name, int std, int loc)
+{
+	char path[1 << 10];
+	struct stat st;
+	int i;
+	for (i = std ? nlocs - 1 : nlocs; i > loc; i--) {
+		if (!dir_has(i, name))
+			continue;
+		inc_path(path, i, name);
+		if (!stat(path, &st))
+			return 0;
+	}
+	return 1;
+}
+
+static int include_find(char *name, int std)
+{
+	char key[NAMELEN + 2];
+	int *offs, *idx, *loc, *rg;
+	char *dat;
+	int i, inc;
+	if (rgen != gen)
+		dirs_check();
+	offs = mem_buf(&rkeys);
+	idx = mem_buf(&rincs);
+	loc = mem_buf(&rlocs);
+	rg = mem_buf(&rgens);
+	dat = mem_buf(&rdat);
+	key[0] = std ? '<' : '"';
+	strcpy(key + 1, name);
+	for (i = tab_find(&rtab, key); i >= 0; i = tab_next(&rtab, i)) {
+		if (!strcmp(key, dat + offs[i])) {
+			/* resolved before the last cpp_renew() */
+			if (rg[i] != gen && !include_valid(name, std, loc[i]))
+				break;
+			rg[i] = gen;
+			stat_hits++;
+			return include_file(incs[idx[i]].path) < 0 ? -1 : 0;
+		}
+	}
+	stat_misses++;
+	for (i = std ? nlocs - 1 : nlocs; i >= 0; i--) {
+		char path[1 << 10];
+		if (!dir_has(i, name)) {
+			stat_skips++;
+			continue;
+		}
+		inc_path(path, i, name);
+		if ((inc = include_file(path)) >= 0) {
+			int off = mem_len(&rdat);
+			mem_put(&rdat, key, strlen(key) + 1);
+			mem_put(&rkeys, &off, sizeof(off));
+			mem_put(&rincs, &inc, sizeof(inc));
+			mem_put(&rlocs, &i, sizeof(i));
+			mem_put(&rgens, &gen, sizeof(gen));
+			tab_add(&rtab, key);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* forget the included files and the include names resolved to them */
+static void inc_free(void)
+{
+	int i;
+	for (i = 0; i < nincs; i++) {
+		free(incs[i].path);
+		inc_drop(i);
+	}
+	free(incs);
+	incs = NULL;
+	nincs = 0;
+	szincs = 0;
+	tab_done(&inctab);
+	rtab_free();
+}
+
+static void stats_reset(void)
+{
+	stat_hits = 0;
+	stat_misses = 0;
+	stat_opens = 0;
+	stat_skips = 0;
+	stat_reuses = 0;
+	stat_maps = 0;
+	stat_mapped = 0;
+	stat_reads = 0;
+	stat_copied = 0;
+	stat_finds = 0;
+	stat_cmps = 0;
+	stat_cmtskip = 0;
+	stat_ifskip = 0;
+}
+
+/* report include statistics on stderr */
+void cpp_stats(void)
+{
+	struct rusage ru;
+	char msg[256];
+	sprintf(msg, "includes: %d cached, %d searched, %d opened, %d skipped via directory listings, %d not read again\n",
+		stat_hits, stat_misses, stat_opens, stat_skips, stat_reuses);
+	write(2, msg, strlen(msg));
+	getrusage(RUSAGE_SELF, &ru);
+	sprintf(msg, "files: %d mapped (%ld KB), %d read (%ld KB copied), %ld page faults\n",
+		stat_maps, stat_mapped >> 10, stat_reads, stat_copied >> 10,
+		ru.ru_minflt + ru.ru_majflt);
+	write(2, msg, strlen(msg));
+	sprintf(msg, "macros: %d defined, %ld lookups, %ld names compared\n",
+		mcount, stat_finds, stat_cmps);
+	write(2, msg, strlen(msg));
+	sprintf(msg, "skipped: %ld KB in comments, %ld KB in inactive conditionals\n",
+		stat_cmtskip >> 10, stat_ifskip >> 10);
+	write(2, msg, strlen(msg));
 }
 
 static char ebuf[MARGLEN];
@@ -362,7 +1022,9 @@ static int cpp_eval(void)
 static void jumpifs(int jumpelse)
 {
 	int depth = 0;
-	while (cur < len) {
+	int beg = cur;
+	long cmt = stat_cmtskip;
+	while ((cur += scan(buf + cur, len - cur, "#/\"'")) < len) {
 		if (buf[cur] == '#') {
 			char cmd[NAMELEN];
 			cur++;
@@ -390,6 +1052,9 @@ static void jumpifs(int jumpelse)
 			continue;
 		cur++;
 	}
+	/* count the comments in the skipped region only once */
+	stat_cmtskip = cmt;
+	stat_ifskip += cur - beg;
 }
 
 static int cpp_cmd(void)
@@ -429,6 +1094,15 @@ static int cpp_cmd(void)
 	}
 	if (!strcmp("endif", cmd))
 		return 0;
+	if (!strcmp("pragma", cmd)) {
+		char name[NAMELEN];
+		read_word(name);
+		if (!strcmp("once", name) && bufs[nbufs - 1].type == BUF_FILE)
+			incs[bufs[nbufs - 1].inc].once = 1;
+		while (cur < len && buf[cur] != '\n')
+			cur++;
+		return 0;
+	}
 	if (!strcmp("include", cmd)) {
 		char file[NAMELEN];
 		char *s, *e;
@@ -446,40 +1120,53 @@ static int cpp_cmd(void)
 	return 1;
 }
 
-static int macro_arg(struct macro *m, char *arg)
+/* the argument used at cur in a macro definition or -1 */
+static int buf_slot(void)
 {
-	int i;
-	for (i = 0; i < m->nargs; i++)
-		if (!strcmp(arg, m->args[i]))
-			return i;
+	struct buf *mbuf = &bufs[nbufs - 1];
+	int *slots;
+	if (mbuf->type != BUF_MACRO)
+		return -1;
+	slots = mbuf->macro->slots;
+	while (mbuf->slot < mbuf->macro->nslots && slots[mbuf->slot * 2] < cur)
+		mbuf->slot++;
+	if (mbuf->slot < mbuf->macro->nslots && slots[mbuf->slot * 2] == cur)
+		return slots[mbuf->slot * 2 + 1];
 	return -1;
 }
 
+/*
+ * find the macro whose argument appears in the text of an argument;
+ * arguments use the names of the buffer that called their macro
+ * while uses in macro definitions are found by buf_slot()
+ */
 static int buf_arg_find(char *name)
 {
-	int i;
-	for (i = nbufs - 1; i >= 0; i--) {
-		struct buf *mbuf = &bufs[i];
-		struct macro *m = mbuf->macro;
-		if (mbuf->type == BUF_MACRO && macro_arg(m, name) >= 0)
-			return i;
-		if (mbuf->type == BUF_ARG)
-			i = mbuf->arg_buf;
-	}
+	int i = nbufs - 1;
+	if (bufs[i].type != BUF_ARG)
+		return -1;
+	while (i >= 0 && bufs[i].type == BUF_ARG)
+		i = bufs[i].arg_buf - 1;
+	if (i >= 0 && bufs[i].type == BUF_MACRO && macro_arg(bufs[i].macro, name) >= 0)
+		return i;
 	return -1;
 }
 
+static int seen_arg = -1;	/* the argument seen by buf_slot() */
+
 static void macro_expand(char *name)
 {
 	struct macro *m;
-	int mbuf;
-	if ((mbuf = buf_arg_find(name)) >= 0) {
-		int arg = macro_arg(bufs[mbuf].macro, name);
-		char *dat = bufs[mbuf].args[arg];
-		buf_arg(dat, mbuf);
+	int mbuf = nbufs - 1;
+	int arg = seen_arg;
+	seen_arg = -1;
+	if (arg < 0 && (mbuf = buf_arg_find(name)) >= 0)
+		arg = macro_arg(bufs[mbuf].macro, name);
+	if (arg >= 0) {
+		buf_arg(bufs[mbuf].args[arg], bufs[mbuf].argslen[arg], mbuf);
 		return;
 	}
-	m = &macros[macro_find(name, 0)];
+	m = macros[macro_find(name, 0)];
 	if (!m->isfunc) {
 		buf_macro(m);
 		return;
@@ -491,7 +1178,10 @@ static void macro_expand(char *name)
 		cur++;
 		jumpws();
 		while (cur < len && buf[cur] != ')') {
-			readarg(mbuf->args[i++]);
+			mbuf->args[i] = buf + cur;
+			readarg(NULL);
+			mbuf->argslen[i] = buf + cur - mbuf->args[i];
+			i++;
 			jumpws();
 			if (buf[cur] != ',')
 				break;
@@ -499,7 +1189,7 @@ static void macro_expand(char *name)
 			jumpws();
 		}
 		while (i < m->nargs)
-			mbuf->args[i++][0] = '\0';
+			mbuf->argslen[i++] = 0;
 		cur++;
 		buf_macro(m);
 	}
@@ -527,7 +1217,7 @@ static int expandable(char *word)
 	if (buf_expanding(word))
 		return 0;
 	i = macro_find(word, 0);
-	return i >= 0 ? macros[i].isfunc + 1 : 0;
+	return i >= 0 ? macros[i]->isfunc + 1 : 0;
 }
 
 void cpp_define(char *name, char *def)
@@ -539,28 +1229,146 @@ void cpp_define(char *name, char *def)
 	buf_pop();
 }
 
+/* precompiled headers: save macros and included files */
+void cpp_pchsave(struct mem *mem)
+{
+	int i, j;
+	mem_put(mem, &mcount, sizeof(mcount));
+	for (i = 0; i < mcount; i++) {
+		struct macro *m = macros[i];
+		int hdr[3] = {m->nargs, m->isfunc, m->undef};
+		mem_put(mem, hdr, sizeof(hdr));
+		mem_put(mem, m->name, strlen(m->name) + 1);
+		mem_put(mem, m->def, strlen(m->def) + 1);
+		for (j = 0; j < m->nargs; j++) {
+			char *arg = m->args + j * NAMELEN;
+			mem_put(mem, arg, strlen(arg) + 1);
+		}
+	}
+	mem_put(mem, &nincs, sizeof(nincs));
+	for (i = 0; i < nincs; i++) {
+		struct inc *inc = &incs[i];
+		long hdr[3] = {inc->dev, inc->ino, inc->once};
+		mem_put(mem, hdr, sizeof(hdr));
+		mem_put(mem, inc->path, strlen(inc->path) + 1);
+		mem_put(mem, inc->guard, strlen(inc->guard) + 1);
+	}
+}
+
+/* copy the string at s to d and return the address after it */
+static char *pch_str(char *d, char *s)
+{
+	strcpy(d, s);
+	return s + strlen(s) + 1;
+}
+
+/* replace macros with those saved in s and mark the included files */
+char *cpp_pchload(char *s)
+{
+	char args[NARGS][NAMELEN];
+	int i, j, n;
+	macro_freeall();
+	tab_pop(&mtab, 0);
+	memcpy(&n, s, sizeof(n));
+	s += sizeof(n);
+	for (i = 0; i < n; i++) {
+		struct macro *m;
+		char *def;
+		int hdr[3];
+		memcpy(hdr, s, sizeof(hdr));
+		s += sizeof(hdr);
+		j = macro_new(s);
+		m = macros[j];
+		s += strlen(s) + 1;
+		m->isfunc = hdr[1];
+		m->undef = hdr[2];
+		def = s;
+		s += strlen(s) + 1;
+		for (j = 0; j < hdr[0]; j++)
+			s = pch_str(args[j], s);
+		macro_set(m, def, args, hdr[0]);
+	}
+	memcpy(&n, s, sizeof(n));
+	s += sizeof(n);
+	for (i = 0; i < n; i++) {
+		struct inc *inc;
+		struct stat st;
+		long hdr[3];
+		memcpy(hdr, s, sizeof(hdr));
+		s += sizeof(hdr);
+		memset(&st, 0, sizeof(st));
+		st.st_dev = hdr[0];
+		st.st_ino = hdr[1];
+		if ((j = inc_find(s)) < 0)
+			j = inc_add(s, &st);
+		inc = &incs[j];
+		if (inc->dev != st.st_dev || inc->ino != st.st_ino) {
+			inc_drop(j);
+			inc->dev = st.st_dev;
+			inc->ino = st.st_ino;
+		}
+		inc->once = hdr[2];
+		inc->tu = tu;
+		s += strlen(s) + 1;
+		s = pch_str(inc->guard, s);
+	}
+	return s;
+}
+
 static int seen_macro;		/* seen a macro; 2 if a function macro */
 static char seen_name[NAMELEN];	/* the name of the last macro */
 
 static int hunk_off;
 static int hunk_len;
 
+/*
+ * cpp_all() preprocesses the rest of the input at once, so that it can
+ * be hashed before compiling.  cpp_read() then returns its output, and
+ * cpp_loc() finds locations in it using the file and line saved for
+ * each hunk.
+ */
+struct pploc {
+	long off;		/* the offset of the hunk in pp */
+	int path;		/* the offset of its file name in pp_paths */
+	int line;		/* the line of its first byte or of the macro use */
+	int file;		/* the hunk comes from the file, not a macro */
+};
+
+static struct mem pp;		/* cpp_all() output */
+static struct mem pp_locs;	/* the location of its hunks */
+static struct mem pp_paths;	/* file names */
+static int pp_on;		/* cpp_read() returns pp */
+static long pp_pos;		/* the next byte of pp for cpp_read() */
+static int pp_hunk;		/* the hunk starting at pp_pos */
+
 int cpp_read(char **obuf, int *olen)
 {
 	int old, end;
 	int jump_name = 0;
 	*olen = 0;
 	*obuf = "";
+	if (pp_on) {
+		struct pploc *locs = mem_buf(&pp_locs);
+		int n = mem_len(&pp_locs) / sizeof(locs[0]);
+		int i = pp_hunk + 1;
+		if (pp_pos == mem_len(&pp))
+			return -1;
+		/* whole hunks, up to 64KB; tokens may span 64KB pieces of pp */
+		while (i + 1 < n && locs[i + 1].off - pp_pos <= (1 << 16))
+			i++;
+		*obuf = (char *) mem_buf(&pp) + pp_pos;
+		*olen = (i < n ? locs[i].off : mem_len(&pp)) - pp_pos;
+		pp_pos += *olen;
+		pp_hunk = i;
+		return 0;
+	}
 	if (seen_macro == 1) {
 		macro_expand(seen_name);
 		seen_macro = 0;
 	}
 	if (cur == len) {
-		struct buf *cbuf = &bufs[nbufs - 1];
 		if (nbufs < bufs_limit + 1)
 			return -1;
-		if (cbuf->type == BUF_FILE)
-			free(buf);
 		buf_pop();
 	}
 	old = cur;
@@ -585,8 +1393,9 @@ int cpp_read(char **obuf, int *olen)
 			continue;
 		if (isalnum(buf[cur]) || buf[cur] == '_') {
 			char word[NAMELEN];
+			seen_arg = buf_slot();
 			read_word(word);
-			seen_macro = expandable(word);
+			seen_macro = seen_arg >= 0 ? 1 : expandable(word);
 			if (seen_macro) {
 				strcpy(seen_name, word);
 				jump_name = 1;
@@ -910,11 +1719,85 @@ static int buf_loc(char *s, int off)
 	return n;
 }
 
+/* the line at offset pos of a file buffer; lines are counted once */
+static int buf_line(struct buf *b, char *s, int pos)
+{
+	if (pos < b->lpos) {
+		b->lpos = 0;
+		b->line = 1;
+	}
+	for (; b->lpos < pos; b->lpos++)
+		if (s[b->lpos] == '\n')
+			b->line++;
+	return b->line;
+}
+
+/* preprocess the rest of the input; cpp_read() returns the output later */
+void cpp_all(char **out, int *olen)
+{
+	struct pploc loc;
+	int last = -1;
+	char *s;
+	int n, i;
+	while (!cpp_read(&s, &n)) {
+		if (!n)
+			continue;
+		for (i = nbufs - 1; i > 0; i--)
+			if (bufs[i].type == BUF_FILE)
+				break;
+		loc.off = mem_len(&pp);
+		loc.file = i == nbufs - 1;
+		if (loc.file)
+			loc.line = buf_line(&bufs[i], buf, cur - hunk_len);
+		else
+			loc.line = buf_line(&bufs[i], bufs[i].buf, bufs[i].cur);
+		if (last < 0 || strcmp((char *) mem_buf(&pp_paths) + last, bufs[i].path)) {
+			last = mem_len(&pp_paths);
+			mem_put(&pp_paths, bufs[i].path, strlen(bufs[i].path) + 1);
+		}
+		loc.path = last;
+		mem_put(&pp_locs, &loc, sizeof(loc));
+		mem_put(&pp, s, n);
+	}
+	pp_on = 1;
+	pp_pos = 0;
+	pp_hunk = 0;
+	*out = mem_buf(&pp);
+	*olen = mem_len(&pp);
+}
+
+/* the location of addr in cpp_all() output */
+static char *pp_loc(char *loc, long addr)
+{
+	struct pploc *locs = mem_buf(&pp_locs);
+	char *s = mem_buf(&pp);
+	int lo = 0;
+	int hi = mem_len(&pp_locs) / sizeof(locs[0]);
+	int line;
+	long i;
+	while (lo + 1 < hi) {
+		int mid = (lo + hi) / 2;
+		if (locs[mid].off <= addr)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	line = locs[lo].line;
+	if (locs[lo].file)
+		for (i = locs[lo].off; i < addr && i < mem_len(&pp); i++)
+			if (s[i] == '\n')
+				line++;
+	sprintf(loc, "%s:%d", (char *) mem_buf(&pp_paths) + locs[lo].path, line);
+	return loc;
+}
+
 char *cpp_loc(long addr)
 {
 	static char loc[256];
 	int line = -1;
 	int i;
+	if (pp_on && mem_len(&pp_locs))
+		return pp_loc(loc, addr);
 	for (i = nbufs - 1; i > 0; i--)
 		if (bufs[i].type == BUF_FILE)
 			break;
@@ -925,3 +1808,56 @@ char *cpp_loc(long addr)
 	sprintf(loc, "%s:%d", bufs[i].path, line);
 	return loc;
 }
+
+/* forget the macros and the input; included files are kept */
+void cpp_reset(void)
+{
+	nbufs = 0;
+	bufs_limit = 1;
+	buf = NULL;
+	len = 0;
+	cur = 0;
+	macro_freeall();
+	free(macros);
+	macros = NULL;
+	msize = 0;
+	tab_done(&mtab);
+	seen_macro = 0;
+	hunk_off = 0;
+	hunk_len = 0;
+	pp_on = 0;
+	pp_pos = 0;
+	pp_hunk = 0;
+	mem_done(&pp);
+	mem_done(&pp_locs);
+	mem_done(&pp_paths);
+	tu++;
+}
+
+/* release the state of the preprocessor; cpp_init() may follow */
+void cpp_done(void)
+{
+	int i;
+	cpp_reset();
+	inc_free();
+	for (i = 0; i <= NLOCS; i++)
+		dir_free(&dirs[i]);
+	mem_done(&rpath);
+	memset(locs, 0, nlocs * sizeof(locs[0]));
+	nlocs = 0;
+	stats_reset();
+}
+
+/*
+ * start another compilation in a long-running process: the search
+ * paths are cleared; included files, directory listings and resolved
+ * names are checked before their next use and kept if still valid
+ */
+void cpp_renew(char *cwd)
+{
+	snprintf(rcwd, sizeof(rcwd), "%s", cwd);
+	memset(locs, 0, nlocs * sizeof(locs[0]));
+	nlocs = 0;
+	gen++;
+	stats_reset();
+}
@@ -7,6 +7,7 @@
 #include "ncc.h"
 #include "out.h"
 #include "reg.h"
+#include "tab.h"
 #include "tok.h"
 
 /* variable location */
@@ -19,10 +20,15 @@
 #define MIN(a, b)		((a) < (b) ? (a) : (b))
 #define ALIGN(x, a)		(((x) + (a) - 1) & ~((a) - 1))
 
-char cs[SECLEN];		/* code segment */
+char *cs;			/* code segment */
 int cslen;
+static int cssz;		/* allocated size of cs[] */
+static long csdrop;		/* bytes discarded after the first pass */
 static struct mem ds;		/* data segment */
 static long bsslen;		/* bss segment size */
+static struct mem frec;		/* out_sym() and out_rel() calls (o_frec()) */
+static long frec_ds;		/* ds length before the recorded function */
+static long frec_bss;		/* bss length before the recorded function */
 
 static long sp;			/* stack pointer offset from R_RBP */
 static long sp_max;		/* maximum stack pointer offset */
@@ -37,6 +43,7 @@ static int func_varg;
 
 /* function statistics */
 int pass1;			/* collect statistics; 1st pass */
+int farsym;			/* symbol addresses may not fit in 32 bits */
 static int stat_calls;		/* # of function calls */
 static int stat_tmps;		/* # of stack temporaries  */
 static int stat_regs;		/* mask of used registers */
@@ -53,7 +60,7 @@ static int tmp_mask;		/* registers that can be used for tmps */
 
 static struct tmp {
 	long addr;
-	char sym[NAMELEN];
+	int sym;	/* symbol atom */
 	long off;	/* offset from a symbol or a local */
 	unsigned loc;	/* variable location */
 	unsigned bt;	/* type of address; zero when not a pointer */
@@ -112,14 +119,47 @@ static void jmp_fill(void)
 
 /* generating code */
 
+/* make room for n more bytes in cs[] */
+static void cs_grow(int n)
+{
+	while (cslen + n > cssz)
+		cssz = cssz ? cssz * 2 : CSLEN;
+	cs = realloc(cs, cssz);
+	if (!cs)
+		die("nomem: code segment too large!\n");
+}
+
 void os(void *s, int n)
 {
-	while (n--)
-		cs[cslen++] = *(char *) (s++);
+	if (cslen + n > cssz)
+		cs_grow(n);
+	memcpy(cs + cslen, s, n);
+	cslen += n;
 }
 
 void oi(long n, int l)
 {
+	unsigned char *d;
+	if (cslen + l > cssz)
+		cs_grow(l);
+	d = (void *) cs + cslen;
+	cslen += l;
+	switch (l) {
+	case 8:
+		d[7] = n >> 56;
+		d[6] = n >> 48;
+		d[5] = n >> 40;
+		d[4] = n >> 32;
+	case 4:
+		d[3] = n >> 24;
+		d[2] = n >> 16;
+	case 2:
+		d[1] = n >> 8;
+	case 1:
+		d[0] = n;
+		return;
+	}
+	cslen -= l;
 	while (l--) {
 		cs[cslen++] = n;
 		n >>= 8;
@@ -171,7 +211,7 @@ static void tmp_reg(struct tmp *tmp, int dst, int deref)
 		tmp->loc = LOC_REG;
 	}
 	if (tmp->loc == LOC_SYM) {
-		i_sym(dst, tmp->sym, tmp->off);
+		i_sym(dst, atom_name(tmp->sym), tmp->off);
 		tmp->addr = dst;
 		regs[dst] = tmp;
 		tmp->loc = LOC_REG;
@@ -291,10 +331,10 @@ void o_num(long num)
 	t->loc = LOC_NUM;
 }
 
-void o_sym(char *name)
+void o_sym(int name)
 {
 	struct tmp *t = tmp_new();
-	strcpy(t->sym, name);
+	t->sym = name;
 	t->loc = LOC_SYM;
 	t->bt = 0;
 	t->off = 0;
@@ -846,7 +886,7 @@ void o_call(int argc, int rets)
 	tmp_drop(aregs);
 	t = TMP(0);
 	if (t->loc == LOC_SYM && !t->bt) {
-		i_call(t->sym, t->off);
+		i_call(atom_name(t->sym), t->off);
 		tmp_drop(1);
 	} else {
 		int reg = reg_tmp(t, R_TMPS, 1);
@@ -858,19 +898,19 @@ void o_call(int argc, int rets)
 	stat_calls++;
 }
 
-void o_bsnew(char *name, int size, int global)
+void o_bsnew(int name, int size, int global)
 {
 	if (pass1)
 		return;
-	out_sym(name, OUT_BSS | (global ? OUT_GLOB : 0), bsslen, size);
+	out_sym(atom_name(name), OUT_BSS | (global ? OUT_GLOB : 0), bsslen, size);
 	bsslen += ALIGN(size, OUT_ALIGNMENT);
 }
 
-static char dat_names[NDATS][NAMELEN];
+static int dat_names[NDATS];
 static int dat_offs[NDATS];
 static int ndats;
 
-long o_dsnew(char *name, int size, int global)
+long o_dsnew(int name, int size, int global)
 {
 	int idx;
 	if (pass1)
@@ -878,9 +918,9 @@ long o_dsnew(char *name, int size, int global)
 	idx = ndats++;
 	if (idx >= NDATS)
 		err("nomem: NDATS reached!\n");
-	strcpy(dat_names[idx], name);
+	dat_names[idx] = name;
 	dat_offs[idx] = mem_len(&ds);
-	out_sym(name, OUT_DS | (global ? OUT_GLOB : 0), mem_len(&ds), size);
+	out_sym(atom_name(name), OUT_DS | (global ? OUT_GLOB : 0), mem_len(&ds), size);
 	mem_putz(&ds, ALIGN(size, OUT_ALIGNMENT));
 	return dat_offs[idx];
 }
@@ -891,16 +931,16 @@ void o_dscpy(long addr, void *buf, int len)
 		mem_cpy(&ds, addr, buf, len);
 }
 
-static int dat_off(char *name)
+static int dat_off(int name)
 {
 	int i;
 	for (i = 0; i < ndats; i++)
-		if (!strcmp(name, dat_names[i]))
+		if (name == dat_names[i])
 			return dat_offs[i];
 	return 0;
 }
 
-void o_dsset(char *name, int off, unsigned bt)
+void o_dsset(int name, int off, unsigned bt)
 {
 	struct tmp *t = TMP(0);
 	int sym_off = dat_off(name) + off;
@@ -913,16 +953,65 @@ void o_dsset(char *name, int off, unsigned bt)
 		mem_cpy(&ds, sym_off, &t->addr, BT_SZ(bt));
 	}
 	if (t->loc == LOC_SYM && !t->bt) {
-		out_rel(t->sym, OUT_DS, sym_off);
+		out_rel(atom_name(t->sym), OUT_DS, sym_off);
 		mem_cpy(&ds, sym_off, &t->off, BT_SZ(bt));
 	}
 	tmp_drop(1);
 }
 
-void o_write(int fd)
+/* return nonzero if no code or data is generated yet */
+int o_empty(void)
+{
+	return !cslen && !mem_len(&ds) && !bsslen;
+}
+
+/* the number of bytes emitted, including those of the first passes */
+long o_emitted(void)
+{
+	return csdrop + cslen;
+}
+
+/* write the object file; returns nonzero on failure */
+int o_write(int fd)
 {
 	i_done();
-	out_write(fd, cs, cslen, mem_buf(&ds), mem_len(&ds));
+	return out_write(fd, cs, cslen, mem_buf(&ds), mem_len(&ds));
+}
+
+/* append the object file to mem */
+void o_mem(struct mem *mem)
+{
+	i_done();
+	out_mem(mem, cs, cslen, mem_buf(&ds), mem_len(&ds));
+}
+
+/* release the generated code and data; the next compilation may start */
+void o_done(void)
+{
+	free(cs);
+	cs = NULL;
+	cslen = 0;
+	cssz = 0;
+	csdrop = 0;
+	mem_done(&ds);
+	bsslen = 0;
+	ndats = 0;
+	pass1 = 0;
+	pass2 = 0;
+	ntmp = 0;
+	memset(regs, 0, sizeof(regs));
+	nlabels = 0;
+	njmps = 0;
+	nlocals = 0;
+	mem_done(&frec);
+	out_done();
+}
+
+/* link the generated code in memory; returns the address of name */
+void *o_link(char *name)
+{
+	i_done();
+	return out_link(cs, cslen, mem_buf(&ds), mem_len(&ds), name);
 }
 
 static void func_reset(void)
@@ -947,7 +1036,7 @@ static void func_reset(void)
 	}
 }
 
-void o_func_beg(char *name, int argc, int global, int varg)
+void o_func_beg(int name, int argc, int global, int varg)
 {
 	func_argc = argc;
 	func_varg = varg;
@@ -956,7 +1045,7 @@ void o_func_beg(char *name, int argc, int global, int varg)
 	pass2 = 0;
 	tmp_mask = N_TMPS > 6 ? R_TMPS & ~R_SAVED : R_TMPS;
 	r_func(argc, varg);
-	out_sym(name, (global ? OUT_GLOB : 0) | OUT_CS, cslen, 0);
+	out_sym(atom_name(name), (global ? OUT_GLOB : 0) | OUT_CS, cslen, 0);
 	i_prolog(argc, varg, r_sargs(), tmp_mask & R_SAVED, 1, 1);
 	func_reset();
 }
@@ -974,6 +1063,7 @@ void o_pass2(void)
 	o_label(0);
 	jmp_fill();
 	leaf = !stat_calls;
+	csdrop += cslen - func_beg;
 	cslen = func_beg;
 	locregs = r_alloc(leaf, stat_regs);
 	subsp = nlocals > locregs || !leaf;
@@ -998,3 +1088,58 @@ void o_func_end(void)
 	jmp_fill();
 	i_epilog(sp_max);
 }
+
+/* record the output of the current function for replaying it later */
+void o_frec(void)
+{
+	frec_ds = mem_len(&ds);
+	frec_bss = bsslen;
+	mem_cut(&frec, 0);
+	out_rec(&frec, func_beg, frec_ds, frec_bss);
+}
+
+/* append the output recorded since o_frec() to mem; nonzero on failure */
+int o_fsave(struct mem *mem)
+{
+#ifndef NEATCC_ARM
+	int n[4] = {cslen - func_beg, mem_len(&ds) - frec_ds,
+		bsslen - frec_bss, mem_len(&frec)};
+	out_rec(NULL, 0, 0, 0);
+	mem_put(mem, n, sizeof(n));
+	mem_put(mem, cs + func_beg, n[0]);
+	mem_put(mem, (char *) mem_buf(&ds) + frec_ds, n[1]);
+	mem_put(mem, mem_buf(&frec), n[3]);
+	return 0;
+#else
+	out_rec(NULL, 0, 0, 0);
+	return 1;	/* the division routines of i_done() are not recorded */
+#endif
+}
+
+/* check that the len bytes at s hold a function saved by o_fsave() */
+int o_fcheck(char *s, int len)
+{
+	int n[4];
+	if (len < sizeof(n))
+		return 1;
+	memcpy(n, s, sizeof(n));
+	if (n[0] < 0 || n[1] < 0 || n[2] < 0 || n[3] < 0 ||
+			(long) n[0] + n[1] + n[3] > len - sizeof(n))
+		return 1;
+	return out_rcheck(s + sizeof(n) + n[0] + n[1], n[3], n[0], n[1], n[2]);
+}
+
+/* replace the current function with one saved by o_fsave() */
+void o_fload(char *s, char *(*sym)(char *name))
+{
+	int n[4];
+	memcpy(n, s, sizeof(n));
+	s += sizeof(n);
+	cslen = func_beg;
+	cs_grow(n[0]);
+	memcpy(cs + cslen, s, n[0]);
+	cslen += n[0];
+	out_replay(s + n[0] + n[1], n[3], func_beg, mem_len(&ds), bsslen, sym);
+	mem_put(&ds, s + n[0], n[1]);
+	bsslen += n[2];
+}
@@ -43,7 +43,7 @@ int o_popnum(long *c);
 /* pushing values to the stack */
 void o_num(long n);
 void o_local(long addr);
-void o_sym(char *sym);
+void o_sym(int sym);		/* sym is an atom (tab.h) */
 void o_tmpdrop(int n);
 void o_tmpswap(void);
 void o_tmpcopy(void);
@@ -61,15 +61,26 @@ void o_fork(void);
 void o_forkpush(void);
 void o_forkjoin(void);
 /* data/bss sections */
-long o_dsnew(char *name, int size, int global);
+long o_dsnew(int name, int size, int global);
 void o_dscpy(long addr, void *buf, int len);
-void o_dsset(char *name, int off, unsigned bt);
-void o_bsnew(char *name, int size, int global);
+void o_dsset(int name, int off, unsigned bt);
+void o_bsnew(int name, int size, int global);
 /* functions */
-void o_func_beg(char *name, int argc, int global, int vararg);
+void o_func_beg(int name, int argc, int global, int vararg);
 void o_func_end(void);
 /* output */
-void o_write(int fd);
+int o_write(int fd);
+struct mem;
+void o_mem(struct mem *mem);
+void o_done(void);
+void *o_link(char *name);
+int o_empty(void);
+long o_emitted(void);
+/* recording and replaying functions */
+void o_frec(void);
+int o_fsave(struct mem *mem);
+void o_fload(char *s, char *(*sym)(char *name));
+int o_fcheck(char *s, int len);
 /* passes */
 void o_pass1(void);
 void o_pass2(void);
@@ -168,9 +179,10 @@ extern int tmpregs[];
 extern int argregs[];
 
 /* code segment text */
-extern char cs[];		/* code segment */
+extern char *cs;		/* code segment */
 extern int cslen;		/* code segment length */
 extern int pass1;		/* first pass */
+extern int farsym;		/* symbol addresses may not fit in 32 bits */
 
 void os(void *s, int n);
 void oi(long n, int l);
@@ -0,0 +1,18 @@
+/*
+ * neatcc library interface
+ *
+ * ncc_compile() compiles the len bytes of C source at src, reported as
+ * path in error messages, into an ELF object.  defs and paths are
+ * NULL-terminated lists of macro definitions (NAME or NAME=VALUE, as
+ * with -D) and include directories (as with -I); either may be NULL.
+ * On success, it returns zero and stores the object, allocated with
+ * malloc(), in *obj and its size in *objlen.  Otherwise, it returns
+ * nonzero and ncc_error() describes the error.
+ *
+ * The state of the compiler is released after each call, so it may be
+ * called repeatedly in the same process, but not from several threads
+ * at once.  Programs linking libncc.a need -ldl.
+ */
+int ncc_compile(char *path, char *src, int len, char **defs, char **paths,
+		char **obj, int *objlen);
+char *ncc_error(void);
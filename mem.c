@@ -5,6 +5,7 @@
 #include "mem.h"
 
 #define MEMSZ		512
+#define ARENASZ		(1 << 16)	/* arena block size */
 
 static void mem_extend(struct mem *mem)
 {
@@ -73,3 +74,59 @@ int mem_len(struct mem *mem)
 {
 	return mem->n;
 }
+
+/*
+ * allocate sz zeroed bytes from the arena; requests larger than ARENASZ
+ * take a whole block of their own
+ */
+void *arena_alloc(struct arena *a, int sz)
+{
+	char **blks;
+	long *lens;
+	long i;
+	char *d;
+	sz = (sz + 7) & ~7;
+	if (a->pos % ARENASZ && a->pos % ARENASZ + sz > ARENASZ)
+		a->pos += ARENASZ - a->pos % ARENASZ;
+	i = a->pos / ARENASZ;
+	if (i >= mem_len(&a->blks) / sizeof(char *)) {
+		long n = sz > ARENASZ ? sz : ARENASZ;
+		char *blk = malloc(n);
+		mem_put(&a->blks, &blk, sizeof(blk));
+		mem_put(&a->lens, &n, sizeof(n));
+	}
+	blks = mem_buf(&a->blks);
+	lens = mem_buf(&a->lens);
+	if (lens[i] < sz) {
+		free(blks[i]);
+		blks[i] = malloc(sz);
+		lens[i] = sz;
+	}
+	d = blks[i] + a->pos % ARENASZ;
+	memset(d, 0, sz);
+	a->pos += sz < ARENASZ ? sz : ARENASZ;
+	return d;
+}
+
+/* the current position; arena_pop() releases the allocations after it */
+long arena_mark(struct arena *a)
+{
+	return a->pos;
+}
+
+/* release the allocations after mark; the blocks are kept for reuse */
+void arena_pop(struct arena *a, long mark)
+{
+	a->pos = mark;
+}
+
+void arena_done(struct arena *a)
+{
+	char **blks = mem_buf(&a->blks);
+	int i;
+	for (i = 0; i < mem_len(&a->blks) / sizeof(char *); i++)
+		free(blks[i]);
+	mem_done(&a->blks);
+	mem_done(&a->lens);
+	a->pos = 0;
+}
@@ -14,3 +14,15 @@ void mem_putc(struct mem *mem, int c);
 void mem_putz(struct mem *mem, int sz);
 void mem_cpy(struct mem *mem, int off, void *buf, int len);
 int mem_len(struct mem *mem);
+
+/* arena allocator; allocations after a mark are released together */
+struct arena {
+	struct mem blks;	/* allocated blocks */
+	struct mem lens;	/* the size of each block */
+	long pos;		/* the position of the next allocation */
+};
+
+void *arena_alloc(struct arena *a, int sz);
+long arena_mark(struct arena *a);
+void arena_pop(struct arena *a, long mark);
+void arena_done(struct arena *a);
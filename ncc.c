@@ -20,20 +20,39 @@
  * (ts_binop()).
  *
  */
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include "gen.h"
+#include "libncc.h"
+#include "mem.h"
 #include "ncc.h"
 #include "out.h"
+#include "tab.h"
 #include "tok.h"
 
+#ifndef FICLONE
+#define FICLONE		0x40049409	/* from linux/fs.h */
+#endif
+
 static int nogen;		/* do not generate code, if set */
+static int onepass;		/* compile functions in one pass (-O0) */
 #define o_bop(op)		{if (!nogen) o_bop(op);}
 #define o_uop(op)		{if (!nogen) o_uop(op);}
 #define o_cast(bt)		{if (!nogen) o_cast(bt);}
@@ -129,47 +148,61 @@ void err(char *fmt, ...)
 }
 
 struct name {
-	char name[NAMELEN];
-	char elfname[NAMELEN];	/* local elf name for function static variables */
+	int name;		/* the atom of the name */
+	int elfname;		/* local elf name for function static variables */
 	struct type type;
 	long addr;		/* local stack offset, global data addr, struct offset */
 };
 
+/*
+ * The parser tables below, except locals, are arrays of pointers to
+ * items allocated from arena.  Blocks drop the items defined in them
+ * at their end (readstmt()) and release their memory with arena_pop().
+ */
+static struct arena arena;	/* parser table items */
+
+/* allocate item n of table tab, an array of *sz pointers to items of isz bytes */
+static void *table_add(void *tab, int *sz, int n, int isz)
+{
+	void ***t = tab;
+	if (n >= *sz) {
+		*sz = *sz ? *sz * 2 : 64;
+		*t = realloc(*t, *sz * sizeof(**t));
+	}
+	return (*t)[n] = arena_alloc(&arena, isz);
+}
+
 static struct name locals[NLOCALS];
 static int nlocals;
-static struct name globals[NGLOBALS];
+static struct tab ltab;		/* locals hash table */
+static struct name **globals;
 static int nglobals;
+static int szglobals;
+static struct tab gtab;		/* globals hash table */
 
 static void local_add(struct name *name)
 {
 	if (nlocals >= NLOCALS)
 		err("nomem: NLOCALS reached!\n");
 	memcpy(&locals[nlocals++], name, sizeof(*name));
+	tab_addi(&ltab, name->name);
 }
 
-static int local_find(char *name)
+static int local_find(int name)
 {
-	int i;
-	for (i = nlocals - 1; i >= 0; --i)
-		if (!strcmp(locals[i].name, name))
-			return i;
-	return -1;
+	return tab_findi(&ltab, name);
 }
 
-static int global_find(char *name)
+static int global_find(int name)
 {
-	int i;
-	for (i = nglobals - 1; i >= 0; i--)
-		if (!strcmp(name, globals[i].name))
-			return i;
-	return -1;
+	return tab_findi(&gtab, name);
 }
 
 static void global_add(struct name *name)
 {
-	if (nglobals >= NGLOBALS)
-		err("nomem: NGLOBALS reached!\n");
-	memcpy(&globals[nglobals++], name, sizeof(*name));
+	struct name *g = table_add(&globals, &szglobals, nglobals++, sizeof(*g));
+	memcpy(g, name, sizeof(*name));
+	tab_addi(&gtab, name->name);
 }
 
 #define LABEL()			(++label)
@@ -179,111 +212,134 @@ static int l_break;		/* current break label */
 static int l_cont;		/* current continue label */
 
 static struct enumval {
-	char name[NAMELEN];
+	int name;
 	int n;
-} enums[NENUMS];
+} **enums;
 static int nenums;
+static int szenums;
+static struct tab etab;		/* enums hash table */
 
-static void enum_add(char *name, int val)
+static void enum_add(int name, int val)
 {
-	struct enumval *ev = &enums[nenums++];
-	if (nenums >= NENUMS)
-		err("nomem: NENUMS reached!\n");
-	strcpy(ev->name, name);
+	struct enumval *ev = table_add(&enums, &szenums, nenums++, sizeof(*ev));
+	ev->name = name;
 	ev->n = val;
+	tab_addi(&etab, name);
 }
 
-static int enum_find(int *val, char *name)
+static int enum_find(int *val, int name)
 {
-	int i;
-	for (i = nenums - 1; i >= 0; --i)
-		if (!strcmp(name, enums[i].name)) {
-			*val = enums[i].n;
-			return 0;
-		}
-	return 1;
+	int i = tab_findi(&etab, name);
+	if (i < 0)
+		return 1;
+	*val = enums[i]->n;
+	return 0;
 }
 
 static struct typdefinfo {
-	char name[NAMELEN];
+	int name;
 	struct type type;
-} typedefs[NTYPEDEFS];
+} **typedefs;
 static int ntypedefs;
+static int sztypedefs;
+static struct tab ttab;		/* typedefs hash table */
 
-static void typedef_add(char *name, struct type *type)
+static void typedef_add(int name, struct type *type)
 {
-	struct typdefinfo *ti = &typedefs[ntypedefs++];
-	if (ntypedefs >= NTYPEDEFS)
-		err("nomem: NTYPEDEFS reached!\n");
-	strcpy(ti->name, name);
+	struct typdefinfo *ti = table_add(&typedefs, &sztypedefs, ntypedefs++,
+						sizeof(*ti));
+	ti->name = name;
 	memcpy(&ti->type, type, sizeof(*type));
+	tab_addi(&ttab, name);
 }
 
-static int typedef_find(char *name)
+static int typedef_find(int name)
 {
-	int i;
-	for (i = ntypedefs - 1; i >= 0; --i)
-		if (!strcmp(name, typedefs[i].name))
-			return i;
-	return -1;
+	return tab_findi(&ttab, name);
 }
 
 static struct array {
 	struct type type;
 	int n;
-} arrays[NARRAYS];
+} **arrays;
 static int narrays;
+static int szarrays;
 
 static int array_add(struct type *type, int n)
 {
-	struct array *a = &arrays[narrays++];
-	if (narrays >= NARRAYS)
-		err("nomem: NARRAYS reached!\n");
+	struct array *a = table_add(&arrays, &szarrays, narrays, sizeof(*a));
 	memcpy(&a->type, type, sizeof(*type));
 	a->n = n;
-	return a - arrays;
+	return narrays++;
 }
 
 static void array2ptr(struct type *t)
 {
 	if (t->flags & T_ARRAY && !t->ptr) {
-		memcpy(t, &arrays[t->id].type, sizeof(*t));
+		memcpy(t, &arrays[t->id]->type, sizeof(*t));
 		t->ptr++;
 	}
 }
 
 static struct structinfo {
-	char name[NAMELEN];
-	struct name fields[NFIELDS];
+	int name;
+	struct name *fields;
 	int nfields;
+	int szfields;		/* allocated fields */
 	int isunion;
 	int size;
-} structs[NSTRUCTS];
+} **structs;
 static int nstructs;
+static int szstructs;
+static struct tab stab;		/* structs hash table */
+static struct tab ftab;		/* struct fields hash table */
+static struct mem fields;	/* struct and field index of ftab entries */
 
-static int struct_find(char *name, int isunion)
+static int struct_find(int name, int isunion)
 {
 	int i;
-	for (i = nstructs - 1; i >= 0; --i)
-		if (*structs[i].name && !strcmp(name, structs[i].name) &&
-				structs[i].isunion == isunion)
+	struct structinfo *si;
+	for (i = tab_findi(&stab, name); i >= 0; i = tab_next(&stab, i))
+		if (name && structs[i]->isunion == isunion)
 			return i;
-	i = nstructs++;
-	if (nstructs >= NSTRUCTS)
-		err("nomem: NSTRUCTS reached!\n");
-	memset(&structs[i], 0, sizeof(structs[i]));
-	strcpy(structs[i].name, name);
-	structs[i].isunion = isunion;
-	return i;
+	si = table_add(&structs, &szstructs, nstructs, sizeof(*si));
+	si->name = name;
+	si->isunion = isunion;
+	tab_addi(&stab, name);
+	return nstructs++;
+}
+
+static void struct_pop(int n, int nfields)
+{
+	nstructs = n;
+	tab_pop(&stab, n);
+	tab_pop(&ftab, nfields);
+	mem_cut(&fields, nfields * 2 * sizeof(int));
 }
 
-static struct name *struct_field(int id, char *name)
+static void field_add(int id, struct name *name)
 {
-	struct structinfo *si = &structs[id];
+	struct structinfo *si = structs[id];
+	int ent[2] = {id, si->nfields};
+	if (si->nfields == si->szfields) {
+		struct name *fields = si->fields;
+		si->szfields = si->szfields ? si->szfields * 2 : 8;
+		si->fields = arena_alloc(&arena, si->szfields * sizeof(*fields));
+		memcpy(si->fields, fields, si->nfields * sizeof(*fields));
+	}
+	memcpy(&si->fields[si->nfields++], name, sizeof(*name));
+	mem_put(&fields, ent, sizeof(ent));
+	tab_addi(&ftab, name->name);
+}
+
+static struct name *struct_field(int id, int name)
+{
+	struct structinfo *si = structs[id];
+	int *ent = mem_buf(&fields);
 	int i;
-	for (i = 0; i < si->nfields; i++)
-		if (!strcmp(name, si->fields[i].name))
-			return &si->fields[i];
+	for (i = tab_findi(&ftab, name); i >= 0; i = tab_next(&ftab, i))
+		if (ent[i * 2] == id)
+			return &si->fields[ent[i * 2 + 1]];
 	err("field not found\n");
 	return NULL;
 }
@@ -294,8 +350,8 @@ static int type_totsz(struct type *t)
 	if (t->ptr)
 		return LONGSZ;
 	if (t->flags & T_ARRAY)
-		return arrays[t->id].n * type_totsz(&arrays[t->id].type);
-	return t->flags & T_STRUCT ? structs[t->id].size : BT_SZ(t->bt);
+		return arrays[t->id]->n * type_totsz(&arrays[t->id]->type);
+	return t->flags & T_STRUCT ? structs[t->id]->size : BT_SZ(t->bt);
 }
 
 /* return t's dereferenced size */
@@ -408,7 +464,7 @@ static void ts_addop(int op)
 }
 
 /* function prototypes for parsing function and variable declarations */
-static int readname(struct type *main, char *name, struct type *base);
+static int readname(struct type *main, int *name, struct type *base);
 static int readtype(struct type *type);
 static int readdefs(void (*def)(void *data, struct name *name, unsigned flags),
 			void *data);
@@ -423,15 +479,16 @@ static void initexpr(struct type *t, int off, void *obj,
 static int type_alignment(struct type *t)
 {
 	if (t->flags & T_ARRAY && !t->ptr)
-		return type_alignment(&arrays[t->id].type);
+		return type_alignment(&arrays[t->id]->type);
 	if (t->flags & T_STRUCT && !t->ptr)
-		return type_alignment(&structs[t->id].fields[0].type);
+		return type_alignment(&structs[t->id]->fields[0].type);
 	return MIN(LONGSZ, type_totsz(t));
 }
 
 static void structdef(void *data, struct name *name, unsigned flags)
 {
-	struct structinfo *si = data;
+	int id = *(int *) data;
+	struct structinfo *si = structs[id];
 	if (si->isunion) {
 		name->addr = 0;
 		if (si->size < type_totsz(&name->type))
@@ -440,21 +497,20 @@ static void structdef(void *data, struct name *name, unsigned flags)
 		struct type *t = &name->type;
 		int alignment = type_alignment(t);
 		if (t->flags & T_ARRAY && !t->ptr)
-			alignment = MIN(LONGSZ, type_totsz(&arrays[t->id].type));
+			alignment = MIN(LONGSZ, type_totsz(&arrays[t->id]->type));
 		si->size = ALIGN(si->size, alignment);
 		name->addr = si->size;
 		si->size += type_totsz(&name->type);
 	}
-	memcpy(&si->fields[si->nfields++], name, sizeof(*name));
+	field_add(id, name);
 }
 
-static int struct_create(char *name, int isunion)
+static int struct_create(int name, int isunion)
 {
 	int id = struct_find(name, isunion);
-	struct structinfo *si = &structs[id];
 	tok_expect('{');
 	while (tok_jmp('}')) {
-		readdefs(structdef, si);
+		readdefs(structdef, &id);
 		tok_expect(';');
 	}
 	return id;
@@ -467,9 +523,9 @@ static void enum_create(void)
 	long n = 0;
 	tok_expect('{');
 	while (tok_jmp('}')) {
-		char name[NAMELEN];
+		int name;
 		tok_expect(TOK_NAME);
-		strcpy(name, tok_id());
+		name = tok_id();
 		if (!tok_jmp('=')) {
 			readexpr();
 			ts_pop_de(NULL);
@@ -487,13 +543,16 @@ static int caseexpr;
 
 static void readpre(void);
 
-static char *tmp_str(char *buf, int len)
+static int nstrs;		/* number of string literals */
+
+static int tmp_str(char *buf, int len)
 {
-	static char name[NAMELEN];
-	static int id;
-	sprintf(name, "__neatcc.s%d", id++);
-	o_dscpy(o_dsnew(name, len, 0), buf, len);
-	return name;
+	char name[NAMELEN];
+	int sym;
+	sprintf(name, "__neatcc.s%d", nstrs++);
+	sym = atom(name);
+	o_dscpy(o_dsnew(sym, len, 0), buf, len);
+	return sym;
 }
 
 static void readprimary(void)
@@ -519,10 +578,9 @@ static void readprimary(void)
 		return;
 	}
 	if (!tok_jmp(TOK_NAME)) {
-		struct name unkn = {""};
-		char *name = unkn.name;
+		struct name unkn = {0};
+		int name = tok_id();
 		int n;
-		strcpy(name, tok_id());
 		/* don't search for labels here */
 		if (!ncexpr && !caseexpr && tok_see() == ':')
 			return;
@@ -533,8 +591,8 @@ static void readprimary(void)
 			return;
 		}
 		if ((n = global_find(name)) != -1) {
-			struct name *g = &globals[n];
-			o_sym(*g->elfname ? g->elfname : g->name);
+			struct name *g = globals[n];
+			o_sym(g->elfname ? g->elfname : g->name);
 			ts_push_addr(&g->type);
 			return;
 		}
@@ -544,7 +602,8 @@ static void readprimary(void)
 			return;
 		}
 		if (tok_see() != '(')
-			err("unknown symbol <%s>\n", name);
+			err("unknown symbol <%s>\n", atom_name(name));
+		unkn.name = name;
 		global_add(&unkn);
 		o_sym(unkn.name);
 		ts_push_bt(LONGSZ);
@@ -633,32 +692,36 @@ static void readfield(void)
 }
 
 static struct funcinfo {
-	struct type args[NARGS];
+	struct type *args;
 	struct type ret;
 	int nargs;
 	int varg;
 	/* function and argument names; useful only when defining */
-	char argnames[NARGS][NAMELEN];
-	char name[NAMELEN];
-} funcs[NFUNCS];
+	int *argnames;
+	int name;
+} **funcs;
 static int nfuncs;
+static int szfuncs;
 
-static int func_create(struct type *ret, char *name, char argnames[][NAMELEN],
+static struct funcinfo *func_new(int nargs)
+{
+	struct funcinfo *fi = table_add(&funcs, &szfuncs, nfuncs++, sizeof(*fi));
+	fi->args = arena_alloc(&arena, nargs * sizeof(fi->args[0]));
+	fi->argnames = arena_alloc(&arena, nargs * sizeof(fi->argnames[0]));
+	fi->nargs = nargs;
+	return fi;
+}
+
+static int func_create(struct type *ret, int name, int *argnames,
 			struct type *args, int nargs, int varg)
 {
-	struct funcinfo *fi = &funcs[nfuncs++];
-	int i;
-	if (nfuncs >= NFUNCS)
-		err("nomem: NFUNCS reached!\n");
+	struct funcinfo *fi = func_new(nargs);
 	memcpy(&fi->ret, ret, sizeof(*ret));
-	for (i = 0; i < nargs; i++)
-		memcpy(&fi->args[i], &args[i], sizeof(*ret));
-	fi->nargs = nargs;
+	memcpy(fi->args, args, nargs * sizeof(args[0]));
+	memcpy(fi->argnames, argnames, nargs * sizeof(argnames[0]));
 	fi->varg = varg;
-	strcpy(fi->name, name ? name : "");
-	for (i = 0; i < nargs; i++)
-		strcpy(fi->argnames[i], argnames[i]);
-	return fi - funcs;
+	fi->name = name;
+	return nfuncs - 1;
 }
 
 static void readcall(void)
@@ -669,7 +732,7 @@ static void readcall(void)
 	ts_pop(&t);
 	if (t.flags & T_FUNC && t.ptr > 0)
 		o_deref(LONGSZ);
-	fi = t.flags & T_FUNC ? &funcs[t.id] : NULL;
+	fi = t.flags & T_FUNC ? funcs[t.id] : NULL;
 	if (tok_see() != ')') {
 		do {
 			readexpr();
@@ -1182,9 +1245,9 @@ static void readestmt(void)
 static void globalinit(void *obj, int off, struct type *t)
 {
 	struct name *name = obj;
-	char *elfname = *name->elfname ? name->elfname : name->name;
+	int elfname = name->elfname ? name->elfname : name->name;
 	if (t->flags & T_ARRAY && tok_see() == TOK_STR) {
-		struct type *t_de = &arrays[t->id].type;
+		struct type *t_de = &arrays[t->id]->type;
 		if (!t_de->ptr && !t_de->flags && TYPE_SZ(t_de) == 1) {
 			char *buf;
 			int len;
@@ -1204,11 +1267,11 @@ static void readfunc(struct name *name, int flags);
 static void globaldef(void *data, struct name *name, unsigned flags)
 {
 	struct type *t = &name->type;
-	char *elfname = *name->elfname ? name->elfname : name->name;
+	int elfname = name->elfname ? name->elfname : name->name;
 	int sz;
-	if (t->flags & T_ARRAY && !t->ptr && !arrays[t->id].n)
+	if (t->flags & T_ARRAY && !t->ptr && !arrays[t->id]->n)
 		if (~flags & F_EXTERN)
-			arrays[t->id].n = initsize();
+			arrays[t->id]->n = initsize();
 	sz = type_totsz(t);
 	if (!(flags & F_EXTERN) && (!(t->flags & T_FUNC) || t->ptr)) {
 		if (tok_see() == '=')
@@ -1237,7 +1300,7 @@ static void localinit(void *obj, int off, struct type *t)
 {
 	long addr = *(long *) obj;
 	if (t->flags & T_ARRAY && tok_see() == TOK_STR) {
-		struct type *t_de = &arrays[t->id].type;
+		struct type *t_de = &arrays[t->id]->type;
 		if (!t_de->ptr && !t_de->flags && TYPE_SZ(t_de) == 1) {
 			char *buf;
 			int len;
@@ -1260,7 +1323,7 @@ static void localinit(void *obj, int off, struct type *t)
 }
 
 /* current function name */
-static char func_name[NAMELEN];
+static int func_name;
 
 static void localdef(void *data, struct name *name, unsigned flags)
 {
@@ -1270,12 +1333,15 @@ static void localdef(void *data, struct name *name, unsigned flags)
 		return;
 	}
 	if (flags & F_STATIC) {
-		sprintf(name->elfname, "__neatcc.%s.%s", func_name, name->name);
+		char elfname[NAMELEN * 2 + 16];
+		sprintf(elfname, "__neatcc.%s.%s", atom_name(func_name),
+			atom_name(name->name));
+		name->elfname = atom(elfname);
 		globaldef(data, name, flags);
 		return;
 	}
-	if (t->flags & T_ARRAY && !t->ptr && !arrays[t->id].n)
-		arrays[t->id].n = initsize();
+	if (t->flags & T_ARRAY && !t->ptr && !arrays[t->id]->n)
+		arrays[t->id]->n = initsize();
 	name->addr = o_mklocal(type_totsz(&name->type));
 	local_add(name);
 	if (!tok_jmp('=')) {
@@ -1313,7 +1379,6 @@ static void readswitch(void)
 	o_local(val_addr);
 	o_tmpswap();
 	o_assign(TYPE_BT(&t));
-	ts_de(0);
 	o_tmpdrop(1);
 	tok_expect(')');
 	tok_expect('{');
@@ -1356,17 +1421,25 @@ static void readswitch(void)
 	l_break = o_break;
 }
 
-static char label_name[NLABELS][NAMELEN];
 static int label_ids[NLABELS];
 static int nlabels;
+static struct tab labtab;	/* labels hash table */
 
-static int label_id(char *name)
+static void label_reset(void)
 {
-	int i;
-	for (i = nlabels - 1; i >= 0; --i)
-		if (!strcmp(label_name[i], name))
-			return label_ids[i];
-	strcpy(label_name[nlabels], name);
+	label = 0;
+	nlabels = 0;
+	tab_pop(&labtab, 0);
+}
+
+static int label_id(int name)
+{
+	int i = tab_findi(&labtab, name);
+	if (i >= 0)
+		return label_ids[i];
+	if (nlabels >= NLABELS)
+		err("nomem: NLABELS reached!\n");
+	tab_addi(&labtab, name);
 	label_ids[nlabels] = LABEL();
 	return label_ids[nlabels++];
 }
@@ -1381,17 +1454,24 @@ static void readstmt(void)
 		int _nenums = nenums;
 		int _ntypedefs = ntypedefs;
 		int _nstructs = nstructs;
+		int _nfields = ftab.n;
 		int _nfuncs = nfuncs;
 		int _narrays = narrays;
+		long _arena = arena_mark(&arena);
 		while (tok_jmp('}'))
 			readstmt();
 		nlocals = _nlocals;
 		nenums = _nenums;
 		ntypedefs = _ntypedefs;
-		nstructs = _nstructs;
+		struct_pop(_nstructs, _nfields);
 		nfuncs = _nfuncs;
 		narrays = _narrays;
 		nglobals = _nglobals;
+		tab_pop(&ltab, nlocals);
+		tab_pop(&etab, nenums);
+		tab_pop(&ttab, ntypedefs);
+		tab_pop(&gtab, nglobals);
+		arena_pop(&arena, _arena);
 		return;
 	}
 	if (!readdefs(localdef, NULL)) {
@@ -1532,32 +1612,140 @@ static void readstmt(void)
 	tok_expect(';');
 }
 
+/*
+ * The function cache: the output of each function is saved with the
+ * hash of its tokens and those of the declarations before it (function
+ * bodies excluded).  Since the parser drops the names defined in
+ * function bodies at their end, the output of a function depends only
+ * on these tokens, except for the numbering of string literals, which
+ * are renamed when the function is replayed.
+ */
+#define FCKEY		33	/* the length of the keys of saved functions */
+
+static struct hsh *fc_decl;	/* the hash of the declarations or NULL */
+static struct mem fc_old;	/* saved functions: key, length and data */
+static struct tab fc_tab;	/* fc_old index */
+static struct mem fc_offs;	/* the offset of fc_tab entries in fc_old */
+static struct mem fc_new;	/* the functions of this unit, as in fc_old */
+static int fc_strs;		/* nstrs minus its value when saved */
+static int fc_hits;		/* functions replayed */
+static int fc_misses;		/* functions compiled */
+
+/* rename the string literals of replayed functions */
+static char *fc_sym(char *name)
+{
+	static char buf[NAMELEN];
+	int n;
+	char c;
+	if (sscanf(name, "__neatcc.s%d%c", &n, &c) != 1)
+		return name;
+	sprintf(buf, "__neatcc.s%d", n + fc_strs);
+	return buf;
+}
+
+/* read the function body and replay its saved output; nonzero if found */
+static int fc_load(char *key)
+{
+	struct hsh h = *fc_decl;
+	int *offs = mem_buf(&fc_offs);
+	char *s;
+	int depth = 0;
+	int tok, len, i;
+	int n[2];
+	tok_hsh(&h);
+	do {
+		tok = tok_get();
+		depth += (tok == '{') - (tok == '}');
+	} while (depth && tok > 0);
+	tok_hsh(fc_decl);
+	hsh_hex(&h, key);
+	for (i = tab_find(&fc_tab, key); i >= 0; i = tab_next(&fc_tab, i))
+		if (!strcmp(key, (char *) mem_buf(&fc_old) + offs[i]))
+			break;
+	if (tok <= 0 || i < 0)
+		return 0;
+	s = (char *) mem_buf(&fc_old) + offs[i];
+	memcpy(&len, s + FCKEY, sizeof(len));
+	mem_put(&fc_new, s, FCKEY + sizeof(len) + len);
+	memcpy(n, s + FCKEY + sizeof(len), sizeof(n));
+	fc_strs = nstrs - n[0];
+	o_fload(s + FCKEY + sizeof(len) + sizeof(n), fc_sym);
+	nstrs += n[1];
+	fc_hits++;
+	return 1;
+}
+
+/* save the output of the current function; strs is nstrs before it */
+static void fc_save(char *key, int strs)
+{
+	int pos = mem_len(&fc_new);
+	int n[2] = {strs, nstrs - strs};
+	int len;
+	mem_put(&fc_new, key, FCKEY);
+	mem_put(&fc_new, &len, sizeof(len));
+	mem_put(&fc_new, n, sizeof(n));
+	if (o_fsave(&fc_new)) {
+		mem_cut(&fc_new, pos);
+		return;
+	}
+	len = mem_len(&fc_new) - pos - FCKEY - sizeof(len);
+	mem_cpy(&fc_new, pos + FCKEY, &len, sizeof(len));
+	fc_misses++;
+}
+
+static void fc_done(void)
+{
+	fc_decl = NULL;
+	mem_done(&fc_old);
+	tab_done(&fc_tab);
+	mem_done(&fc_offs);
+	mem_done(&fc_new);
+}
+
+static void readbody(long beg)
+{
+	/* with -O0, the conservative prologue of o_func_beg() is kept */
+	if (!onepass) {
+		/* first pass: collecting statistics */
+		o_pass1();
+		readstmt();
+		tok_jump(beg);
+		/* second pass: generating code; tokens are replayed */
+		label_reset();
+		o_pass2();
+	}
+	readstmt();
+	o_func_end();
+}
+
 static void readfunc(struct name *name, int flags)
 {
-	struct funcinfo *fi = &funcs[name->type.id];
+	struct funcinfo *fi = funcs[name->type.id];
 	long beg = tok_addr();
+	char key[FCKEY];
+	int strs = nstrs;
 	int i;
-	strcpy(func_name, fi->name);
+	func_name = fi->name;
 	o_func_beg(func_name, fi->nargs, F_GLOBAL(flags), fi->varg);
 	for (i = 0; i < fi->nargs; i++) {
-		struct name arg = {"", "", fi->args[i], o_arg2loc(i)};
-		strcpy(arg.name, fi->argnames[i]);
+		struct name arg = {fi->argnames[i], 0, fi->args[i], o_arg2loc(i)};
 		local_add(&arg);
 	}
-	/* first pass: collecting statistics */
-	label = 0;
-	nlabels = 0;
-	o_pass1();
-	readstmt();
-	tok_jump(beg);
-	/* second pass: generating code */
-	label = 0;
-	nlabels = 0;
-	o_pass2();
-	readstmt();
-	o_func_end();
-	func_name[0] = '\0';
+	label_reset();
+	if (fc_decl || !onepass)
+		tok_rec(1);
+	if (!fc_decl) {
+		readbody(beg);
+	} else if (!fc_load(key)) {
+		tok_jump(beg);
+		o_frec();
+		readbody(beg);
+		fc_save(key, strs);
+	}
+	tok_rec(0);
+	func_name = 0;
 	nlocals = 0;
+	tab_pop(&ltab, 0);
 }
 
 static void readdecl(void)
@@ -1577,6 +1765,54 @@ static void parse(void)
 		readdecl();
 }
 
+/* release the parser state; the next compilation may start */
+static void parse_done(void)
+{
+	arena_done(&arena);
+	nogen = 0;
+	nts = 0;
+	nlocals = 0;
+	tab_done(&ltab);
+	free(globals);
+	globals = NULL;
+	nglobals = 0;
+	szglobals = 0;
+	tab_done(&gtab);
+	free(enums);
+	enums = NULL;
+	nenums = 0;
+	szenums = 0;
+	tab_done(&etab);
+	free(typedefs);
+	typedefs = NULL;
+	ntypedefs = 0;
+	sztypedefs = 0;
+	tab_done(&ttab);
+	free(arrays);
+	arrays = NULL;
+	narrays = 0;
+	szarrays = 0;
+	free(structs);
+	structs = NULL;
+	nstructs = 0;
+	szstructs = 0;
+	tab_done(&stab);
+	tab_done(&ftab);
+	mem_done(&fields);
+	free(funcs);
+	funcs = NULL;
+	nfuncs = 0;
+	szfuncs = 0;
+	nlabels = 0;
+	tab_done(&labtab);
+	label = 0;
+	l_break = 0;
+	l_cont = 0;
+	func_name = 0;
+	nstrs = 0;
+	fc_done();
+}
+
 static void compat_macros(void)
 {
 	cpp_define("__STDC__", "");
@@ -1595,44 +1831,1001 @@ static void compat_macros(void)
 	cpp_define("__builtin_va_list__", "long");
 }
 
-int main(int argc, char *argv[])
+/* define a macro given as NAME or NAME=VALUE */
+static void define(char *s)
 {
-	char obj[128] = "";
-	int ofd;
-	int i = 1;
+	char name[MDEFLEN];
+	char *eq = strchr(s, '=');
+	int n = eq ? eq - s : strlen(s);
+	if (n >= sizeof(name))
+		n = sizeof(name) - 1;
+	memcpy(name, s, n);
+	name[n] = '\0';
+	cpp_define(name, eq ? eq + 1 : "");
+}
+
+/* the library interface; see libncc.h */
+static jmp_buf lib_jmp;		/* where die() returns to */
+static char lib_msg[512];	/* the last error message */
+static struct mem lib_obj;	/* the object being written */
+
+static void lib_die(char *msg)
+{
+	strcpy(lib_msg, msg);
+	longjmp(lib_jmp, 1);
+}
+
+/* release the state of a translation unit; included files are kept */
+static void tu_done(void)
+{
+	parse_done();
+	tok_done();
+	cpp_reset();
+	o_done();
+	atom_done();
+}
+
+static void lib_done(void)
+{
+	tu_done();
+	cpp_done();
+	mem_done(&lib_obj);
+	die_hook = NULL;
+}
+
+int ncc_compile(char *path, char *src, int len, char **defs, char **paths,
+		char **obj, int *objlen)
+{
+	int i;
+	*obj = NULL;
+	*objlen = 0;
+	lib_done();
+	if (setjmp(lib_jmp)) {
+		lib_done();
+		return 1;
+	}
+	die_hook = lib_die;
+	lib_msg[0] = '\0';
 	compat_macros();
+	for (i = 0; paths && paths[i]; i++)
+		cpp_addpath(paths[i]);
+	for (i = 0; defs && defs[i]; i++)
+		define(defs[i]);
+	cpp_initbuf(path, src, len);
+	parse();
+	o_mem(&lib_obj);
+	*objlen = mem_len(&lib_obj);
+	*obj = malloc(*objlen);
+	memcpy(*obj, mem_buf(&lib_obj), *objlen);
+	lib_done();
+	return 0;
+}
+
+char *ncc_error(void)
+{
+	return lib_msg;
+}
+
+#ifndef NCC_LIB
+static int stats;		/* report compilation statistics (-s) */
+static int run;			/* run main() instead of writing an object (-r) */
+static struct mem defs;		/* -D options (char *) */
+static long emitted;		/* code bytes emitted in finished units */
+static struct timeval tv0;	/* compilation start time */
+static char *cache;		/* the cache directory (-C) */
+static struct hsh tu_hsh;	/* the hash of the current unit */
+static char tu_key[1 << 10];	/* its object in the cache or empty */
+static int cache_hits;
+static int cache_misses;
+static struct hsh fc_hsh;	/* tu_hsh before the input; fc_decl after */
+static char fc_path[1 << 10];	/* the saved functions of the current unit */
+
+extern char **environ;
+
+/* precompiled headers */
+#define PCHMAGIC	"NCCPCH2"	/* changes with the file format */
+
+static unsigned long pch_hash;	/* the hash of -I and -D options */
+
+static void pch_addhash(char *s)
+{
+	while (*s)
+		pch_hash = pch_hash * 33 + (unsigned char) *s++;
+	pch_hash = pch_hash * 33 + 1;
+}
+
+/* save the state after parsing the header in hdr */
+static void pch_save(char *path, char *hdr)
+{
+	struct mem mem;
+	int n[6] = {nglobals, nenums, ntypedefs, narrays, nstructs, nfuncs};
+	int natoms = atom_count();
+	int fd;
+	int i;
+	mem_init(&mem);
+	mem_put(&mem, PCHMAGIC, 8);
+	mem_put(&mem, &pch_hash, sizeof(pch_hash));
+	mem_put(&mem, hdr, strlen(hdr) + 1);
+	cpp_pchsave(&mem);
+	mem_put(&mem, &natoms, sizeof(natoms));
+	for (i = 0; i < natoms; i++)
+		mem_put(&mem, atom_name(i), strlen(atom_name(i)) + 1);
+	mem_put(&mem, n, sizeof(n));
+	for (i = 0; i < nglobals; i++)
+		mem_put(&mem, globals[i], sizeof(*globals[i]));
+	for (i = 0; i < nenums; i++)
+		mem_put(&mem, enums[i], sizeof(*enums[i]));
+	for (i = 0; i < ntypedefs; i++)
+		mem_put(&mem, typedefs[i], sizeof(*typedefs[i]));
+	for (i = 0; i < narrays; i++)
+		mem_put(&mem, arrays[i], sizeof(*arrays[i]));
+	for (i = 0; i < nstructs; i++) {
+		struct structinfo *si = structs[i];
+		int h[3] = {si->nfields, si->isunion, si->size};
+		mem_put(&mem, &si->name, sizeof(si->name));
+		mem_put(&mem, h, sizeof(h));
+		mem_put(&mem, si->fields, si->nfields * sizeof(si->fields[0]));
+	}
+	for (i = 0; i < nfuncs; i++) {
+		struct funcinfo *fi = funcs[i];
+		int h[2] = {fi->nargs, fi->varg};
+		mem_put(&mem, &fi->name, sizeof(fi->name));
+		mem_put(&mem, h, sizeof(h));
+		mem_put(&mem, &fi->ret, sizeof(fi->ret));
+		mem_put(&mem, fi->args, fi->nargs * sizeof(fi->args[0]));
+		mem_put(&mem, fi->argnames, fi->nargs * sizeof(fi->argnames[0]));
+	}
+	fd = open(path, O_WRONLY | O_TRUNC | O_CREAT, 0600);
+	if (fd < 0 || write(fd, mem_buf(&mem), mem_len(&mem)) != mem_len(&mem))
+		die("neatcc: cannot write <%s>\n", path);
+	close(fd);
+	mem_done(&mem);
+}
+
+static char *pch_get(void *dst, char *s, int len)
+{
+	memcpy(dst, s, len);
+	return s + len;
+}
+
+/*
+ * load the state saved by pch_save(); returns nonzero if the file
+ * was saved with different options, in which case the path of
+ * its header is copied to hdr
+ */
+static int pch_load(char *path, char *hdr)
+{
+	struct stat st;
+	unsigned long hash;
+	int n[6];
+	int natoms;
+	char *dat, *s;
+	int fd, i, j;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		die("neatcc: cannot open <%s>\n", path);
+	if (fstat(fd, &st) || st.st_size < 16)
+		die("neatcc: bad precompiled header <%s>\n", path);
+	dat = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (dat == MAP_FAILED || memcmp(PCHMAGIC, dat, 8))
+		die("neatcc: bad precompiled header <%s>\n", path);
+	s = pch_get(&hash, dat + 8, sizeof(hash));
+	strcpy(hdr, s);
+	s += strlen(s) + 1;
+	if (hash != pch_hash) {
+		munmap(dat, st.st_size);
+		return 1;
+	}
+	if (cache)
+		hsh_put(&tu_hsh, dat, st.st_size);
+	s = cpp_pchload(s);
+	/* atoms are numbered in the order they are added */
+	s = pch_get(&natoms, s, sizeof(natoms));
+	for (i = 0; i < natoms; i++) {
+		if (atom(s) != i)
+			die("neatcc: bad precompiled header <%s>\n", path);
+		s += strlen(s) + 1;
+	}
+	s = pch_get(n, s, sizeof(n));
+	for (i = 0; i < n[0]; i++) {
+		struct name g;
+		s = pch_get(&g, s, sizeof(g));
+		global_add(&g);
+	}
+	for (i = 0; i < n[1]; i++) {
+		struct enumval ev;
+		s = pch_get(&ev, s, sizeof(ev));
+		enum_add(ev.name, ev.n);
+	}
+	for (i = 0; i < n[2]; i++) {
+		struct typdefinfo ti;
+		s = pch_get(&ti, s, sizeof(ti));
+		typedef_add(ti.name, &ti.type);
+	}
+	for (i = 0; i < n[3]; i++) {
+		struct array a;
+		s = pch_get(&a, s, sizeof(a));
+		array_add(&a.type, a.n);
+	}
+	for (i = 0; i < n[4]; i++) {
+		struct structinfo *si;
+		struct name field;
+		int h[3];
+		si = table_add(&structs, &szstructs, nstructs++, sizeof(*si));
+		s = pch_get(&si->name, s, sizeof(si->name));
+		s = pch_get(h, s, sizeof(h));
+		si->isunion = h[1];
+		si->size = h[2];
+		tab_addi(&stab, si->name);
+		for (j = 0; j < h[0]; j++) {
+			s = pch_get(&field, s, sizeof(field));
+			field_add(i, &field);
+		}
+	}
+	for (i = 0; i < n[5]; i++) {
+		struct funcinfo *fi;
+		int name;
+		int h[2];
+		s = pch_get(&name, s, sizeof(name));
+		s = pch_get(h, s, sizeof(h));
+		fi = func_new(h[0]);
+		fi->name = name;
+		fi->varg = h[1];
+		s = pch_get(&fi->ret, s, sizeof(fi->ret));
+		s = pch_get(fi->args, s, fi->nargs * sizeof(fi->args[0]));
+		s = pch_get(fi->argnames, s, fi->nargs * sizeof(fi->argnames[0]));
+	}
+	munmap(dat, st.st_size);
+	return 0;
+}
+
+static int xread(int fd, void *buf, int len)
+{
+	int nr = 0;
+	while (nr < len) {
+		int ret = read(fd, (char *) buf + nr, len - nr);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		nr += ret;
+	}
+	return nr;
+}
+
+static int xwrite(int fd, void *buf, int len)
+{
+	int nw = 0;
+	while (nw < len) {
+		int ret = write(fd, (char *) buf + nw, len - nw);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		nw += ret;
+	}
+	return nw;
+}
+
+/*
+ * The object cache (-C dir): objects are stored as dir/xx/yyy.o, where
+ * xxyyy is the hash of the compiler executable, the target, the -O and
+ * -D options, the precompiled header, if any, and the preprocessed
+ * input.  The input is preprocessed by cpp_all() before parsing, so it
+ * is not preprocessed again on a miss.
+ */
+
+/* the hash of the compiler itself or NULL; computed once */
+static struct hsh *exe_hsh(void)
+{
+	static struct hsh h;
+	static int done;
+	char buf[1 << 14];
+	int fd, n;
+	if (!done) {
+		done = -1;
+		if ((fd = open("/proc/self/exe", O_RDONLY)) < 0)
+			return NULL;
+		hsh_init(&h);
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			hsh_put(&h, buf, n);
+		close(fd);
+		if (!n)
+			done = 1;
+	}
+	return done > 0 ? &h : NULL;
+}
+
+/* start hashing a translation unit; called before pch_load() */
+static void cache_init(void)
+{
+	char **d = mem_buf(&defs);
+	int i;
+	tu_key[0] = '\0';
+	if (!cache || !exe_hsh())
+		return;
+	tu_hsh = *exe_hsh();
+	hsh_put(&tu_hsh, I_ARCH, strlen(I_ARCH) + 1);
+	hsh_put(&tu_hsh, &onepass, sizeof(onepass));
+	hsh_put(&tu_hsh, &farsym, sizeof(farsym));
+	for (i = 0; i < mem_len(&defs) / sizeof(d[0]); i++)
+		hsh_put(&tu_hsh, d[i], strlen(d[i]) + 1);
+}
+
+/* copy file src to dst, sharing its blocks if possible */
+static int file_copy(char *src, char *dst)
+{
+	char buf[1 << 14];
+	int ifd, ofd;
+	int n, ret = 0;
+	if ((ifd = open(src, O_RDONLY)) < 0)
+		return 1;
+	if ((ofd = open(dst, O_WRONLY | O_TRUNC | O_CREAT, 0600)) < 0) {
+		close(ifd);
+		return 1;
+	}
+	if (ioctl(ofd, FICLONE, ifd)) {
+		while ((n = read(ifd, buf, sizeof(buf))) > 0)
+			if (xwrite(ofd, buf, n) != n)
+				break;
+		ret = n != 0;
+	}
+	close(ifd);
+	return close(ofd) || ret;
+}
+
+/* copy the cached object of the current unit to obj; nonzero on hits */
+static int cache_get(char *obj)
+{
+	char key[40];
+	char *out;
+	int len;
+	if (!cache || !exe_hsh())
+		return 0;
+	cpp_all(&out, &len);
+	fc_hsh = tu_hsh;
+	hsh_put(&tu_hsh, out, len);
+	hsh_hex(&tu_hsh, key);
+	snprintf(tu_key, sizeof(tu_key), "%s/%.2s/%s.o", cache, key, key + 2);
+	if (!file_copy(tu_key, obj)) {
+		cache_hits++;
+		return 1;
+	}
+	cache_misses++;
+	return 0;
+}
+
+/* create the directory of path in the cache */
+static void cache_mkdir(char *path)
+{
+	char *dir = strrchr(path, '/');
+	mkdir(cache, 0777);
+	*dir = '\0';
+	mkdir(path, 0777);
+	*dir = '/';
+}
+
+/* store obj in the cache as the object of the current unit */
+static void cache_put(char *obj)
+{
+	char tmp[1 << 11];
+	if (!tu_key[0])
+		return;
+	cache_mkdir(tu_key);
+	sprintf(tmp, "%s.%d", tu_key, getpid());
+	if (file_copy(obj, tmp) || rename(tmp, tu_key))
+		unlink(tmp);
+	tu_key[0] = '\0';
+}
+
+/*
+ * On object cache misses, the functions of src are saved in
+ * dir/xx/yyy.f, where xxyyy is the hash of the options hashed by
+ * cache_init() and the path of src.  The functions found there are
+ * replayed and only those that have changed are compiled.
+ */
+
+/* index the functions in fc_old */
+static void fc_index(void)
+{
+	char *s = mem_buf(&fc_old);
+	int pos = 0;
+	int len;
+	int n[2];
+	while (pos + FCKEY + sizeof(len) <= mem_len(&fc_old)) {
+		memcpy(&len, s + pos + FCKEY, sizeof(len));
+		if (len < (int) sizeof(n) || s[pos + FCKEY - 1] ||
+				pos + FCKEY + sizeof(len) + len > mem_len(&fc_old))
+			break;
+		/* corrupt records are not indexed and are compiled again */
+		if (!o_fcheck(s + pos + FCKEY + sizeof(len) + sizeof(n),
+				len - sizeof(n))) {
+			tab_add(&fc_tab, s + pos);
+			mem_put(&fc_offs, &pos, sizeof(pos));
+		}
+		pos += FCKEY + sizeof(len) + len;
+	}
+}
+
+/* load the saved functions of src and start hashing its declarations */
+static void fc_init(char *src)
+{
+	char cwd[1 << 10];
+	char key[40];
+	struct hsh h;
+	struct stat st;
+	int fd, n;
+	if (!tu_key[0])
+		return;
+	h = fc_hsh;
+	if (src[0] != '/' && getcwd(cwd, sizeof(cwd)))
+		hsh_put(&h, cwd, strlen(cwd) + 1);
+	hsh_put(&h, src, strlen(src) + 1);
+	hsh_hex(&h, key);
+	snprintf(fc_path, sizeof(fc_path), "%s/%.2s/%s.f", cache, key, key + 2);
+	if ((fd = open(fc_path, O_RDONLY)) >= 0) {
+		if (!fstat(fd, &st)) {
+			mem_putz(&fc_old, st.st_size);
+			n = xread(fd, mem_buf(&fc_old), st.st_size);
+			mem_cut(&fc_old, n);
+			fc_index();
+		}
+		close(fd);
+	}
+	fc_decl = &fc_hsh;
+	tok_hsh(fc_decl);
+}
+
+/* replace the saved functions of the current unit */
+static void fc_write(void)
+{
+	char tmp[1 << 11];
+	int fd, n;
+	if (!fc_decl)
+		return;
+	cache_mkdir(fc_path);
+	sprintf(tmp, "%s.%d", fc_path, getpid());
+	if ((fd = open(tmp, O_WRONLY | O_TRUNC | O_CREAT, 0600)) < 0)
+		return;
+	n = xwrite(fd, mem_buf(&fc_new), mem_len(&fc_new));
+	if (close(fd) || n != mem_len(&fc_new) || rename(tmp, fc_path))
+		unlink(tmp);
+}
+
+/* report preprocessor statistics and code generation throughput */
+static void print_stats(void)
+{
+	char msg[256];
+	struct timeval tv1;
+	long us, n;
+	gettimeofday(&tv1, NULL);
+	cpp_stats();
+	us = (tv1.tv_sec - tv0.tv_sec) * 1000000 + (tv1.tv_usec - tv0.tv_usec);
+	tok_stats(us);
+	n = emitted + o_emitted();
+	sprintf(msg, "code: %ld bytes emitted in %ldus, %ld KB/s\n",
+		n, us, us > 0 ? n * 1000 / us * 1000 / 1024 : 0);
+	write(2, msg, strlen(msg));
+	if (cache) {
+		n = cache_hits + cache_misses;
+		sprintf(msg, "cache: %d hits, %d misses, %ld%% hit rate\n",
+			cache_hits, cache_misses, n ? cache_hits * 100 / n : 0);
+		write(2, msg, strlen(msg));
+		sprintf(msg, "functions: %d replayed, %d compiled\n",
+			fc_hits, fc_misses);
+		write(2, msg, strlen(msg));
+	}
+}
+
+/* start compiling src; the header of pch_in is included if it is stale */
+static void tu_init(char *src, char *pch_in)
+{
+	char hdr[1 << 10];
+	char **d = mem_buf(&defs);
+	int i;
+	compat_macros();
+	for (i = 0; i < mem_len(&defs) / sizeof(d[0]); i++)
+		define(d[i] + 2);
+	cache_init();
+	if (pch_in && pch_load(pch_in, hdr))
+		pch_in = hdr;		/* stale; including its header instead */
+	else
+		pch_in = NULL;
+	if (cpp_init(src))
+		die("neatcc: cannot open <%s>\n", src);
+	if (pch_in && cpp_init(pch_in))
+		die("neatcc: cannot open <%s>\n", pch_in);
+}
+
+static void obj_write(char *obj)
+{
+	int fd = open(obj, O_WRONLY | O_TRUNC | O_CREAT, 0600);
+	if (fd < 0)
+		die("neatcc: cannot open <%s>\n", obj);
+	if (o_write(fd) | close(fd))
+		die("neatcc: cannot write <%s>\n", obj);
+}
+
+/* the object file of src: its name with the last character replaced */
+static void obj_name(char *obj, char *src)
+{
+	strcpy(obj, src);
+	obj[strlen(obj) - 1] = 'o';
+}
+
+static void batch_die(char *msg)
+{
+	write(2, msg, strlen(msg));
+	longjmp(lib_jmp, 1);
+}
+
+/* compile src into its object; nonzero on failure */
+static int batch_one(char *src, char *pch_in)
+{
+	void (*hook)(char *msg) = die_hook;
+	char obj[1 << 10];
+	die_hook = batch_die;
+	if (setjmp(lib_jmp)) {
+		tu_done();
+		die_hook = hook;
+		return 1;
+	}
+	tu_init(src, pch_in);
+	obj_name(obj, src);
+	if (!cache_get(obj)) {
+		fc_init(src);
+		parse();
+		obj_write(obj);
+		emitted += o_emitted();
+		cache_put(obj);
+		fc_write();
+	}
+	tu_done();
+	die_hook = hook;
+	return 0;
+}
+
+/* compile each of srcs[] into its own object; nonzero if any fails */
+static int batch(char **srcs, int n, char *pch_in)
+{
+	int failed = 0;
+	int i;
+	for (i = 0; i < n; i++)
+		failed |= batch_one(srcs[i], pch_in);
+	return failed;
+}
+
+/*
+ * The GNU make jobserver: a pipe (or a fifo since make 4.4) holding a
+ * byte for each free job slot.  Each process owns an implicit slot;
+ * the other workers take a byte before compiling a file and return
+ * it afterwards.
+ */
+static int js_rd = -1;
+static int js_wr = -1;
+static char js_tok = '+';	/* the byte taken from the jobserver */
+
+static void js_init(void)
+{
+	char *s = getenv("MAKEFLAGS");
+	char *a;
+	if (!s)
+		return;
+	if ((a = strstr(s, "--jobserver-auth=fifo:"))) {
+		char path[1 << 10];
+		int i;
+		a += strlen("--jobserver-auth=fifo:");
+		for (i = 0; a[i] && a[i] != ' ' && i < sizeof(path) - 1; i++)
+			path[i] = a[i];
+		path[i] = '\0';
+		js_rd = open(path, O_RDWR);
+		js_wr = js_rd;
+		return;
+	}
+	if (!(a = strstr(s, "--jobserver-auth=")) &&
+			!(a = strstr(s, "--jobserver-fds=")))
+		return;
+	if (sscanf(strchr(a, '=') + 1, "%d,%d", &js_rd, &js_wr) != 2 ||
+			fcntl(js_rd, F_GETFD) < 0 || fcntl(js_wr, F_GETFD) < 0)
+		js_rd = js_wr = -1;
+}
+
+/* take a job slot; returns nonzero if a byte was read */
+static int js_get(void)
+{
+	struct pollfd pfd;
+	while (js_rd >= 0) {
+		int ret = read(js_rd, &js_tok, 1);
+		if (ret == 1)
+			return 1;
+		if (ret == 0 || (errno != EINTR && errno != EAGAIN))
+			return 0;
+		pfd.fd = js_rd;		/* the pipe may be non-blocking */
+		pfd.events = POLLIN;
+		poll(&pfd, 1, -1);
+	}
+	return 0;
+}
+
+static void js_put(void)
+{
+	while (write(js_wr, &js_tok, 1) < 0 && errno == EINTR)
+		;
+}
+
+/* compile the files whose indices are read from fd */
+static int worker(char **srcs, int fd, int own, char *pch_in)
+{
+	int failed = 0;
+	int i;
+	while (read(fd, &i, sizeof(i)) == sizeof(i)) {
+		int slot = !own && js_get();
+		failed |= batch_one(srcs[i], pch_in);
+		if (slot)
+			js_put();
+	}
+	return failed;
+}
+
+/* compile srcs[] in jobs worker processes; nonzero if any fails */
+static int parallel(char **srcs, int n, int jobs, char *pch_in)
+{
+	int failed = 0;
+	int fds[2];
+	int i, st;
+	if (jobs > n)
+		jobs = n;
+	js_init();
+	if (pipe(fds))
+		die("neatcc: pipe failed\n");
+	for (i = 0; i < jobs; i++) {
+		int pid = fork();
+		if (pid < 0)
+			die("neatcc: fork failed\n");
+		if (!pid) {
+			close(fds[1]);
+			failed = worker(srcs, fds[0], i == 0, pch_in);
+			if (stats)
+				print_stats();
+			_exit(failed);
+		}
+	}
+	close(fds[0]);
+	for (i = 0; i < n; i++)
+		write(fds[1], &i, sizeof(i));
+	close(fds[1]);
+	while (wait(&st) > 0)
+		if (!WIFEXITED(st) || WEXITSTATUS(st))
+			failed = 1;
+	return failed;
+}
+
+static int serving;		/* compiling for a client of the server (-S) */
+
+/* compile as requested by the given arguments */
+static int compile(int argc, char *argv[])
+{
+	char obj[1 << 10] = "";
+	char *pch_in = NULL;	/* precompiled header to load (-p) */
+	char *pch_out = NULL;	/* precompiled header to write (-P) */
+	int many = 0;		/* compile many files (-b) */
+	int jobs = 1;		/* parallel jobs (-j) */
+	int i = 1;
+	stats = 0;
+	run = 0;
+	onepass = 0;
+	emitted = 0;
+	cache = NULL;
+	cache_hits = 0;
+	cache_misses = 0;
+	fc_hits = 0;
+	fc_misses = 0;
+	tok_resetstats();
+	mem_cut(&defs, 0);
+	pch_hash = 5381;
+	pch_addhash(I_ARCH);
 	while (i < argc && argv[i][0] == '-') {
-		if (argv[i][1] == 'I')
-			cpp_addpath(argv[i][2] ? argv[i] + 2 : argv[++i]);
+		if (argv[i][1] == 'I') {
+			char *path = argv[i][2] ? argv[i] + 2 : argv[++i];
+			cpp_addpath(path);
+			pch_addhash(path);
+		}
 		if (argv[i][1] == 'D') {
-			char *name = argv[i] + 2;
-			char *def = "";
-			char *eq = strchr(name, '=');
-			if (eq) {
-				*eq = '\0';
-				def = eq + 1;
-			}
-			cpp_define(name, def);
+			pch_addhash(argv[i]);
+			mem_put(&defs, &argv[i], sizeof(argv[i]));
 		}
 		if (argv[i][1] == 'o')
 			strcpy(obj, argv[i][2] ? argv[i] + 2 : argv[++i]);
+		if (argv[i][1] == 'O')
+			onepass = argv[i][2] == '0';
+		if (argv[i][1] == 'p')
+			pch_in = argv[i][2] ? argv[i] + 2 : argv[++i];
+		if (argv[i][1] == 'P')
+			pch_out = argv[i][2] ? argv[i] + 2 : argv[++i];
+		if (argv[i][1] == 's')
+			stats = 1;
+		if (argv[i][1] == 'r')
+			run = 1;
+		if (argv[i][1] == 'b')
+			many = 1;
+		if (argv[i][1] == 'C')
+			cache = argv[i][2] ? argv[i] + 2 : argv[++i];
+		if (argv[i][1] == 'j') {
+			many = 1;
+			jobs = argv[i][2] ? atoi(argv[i] + 2) :
+				sysconf(_SC_NPROCESSORS_ONLN);
+			if (jobs < 1)
+				jobs = 1;
+		}
 		i++;
 	}
 	if (i == argc)
 		die("neatcc: no file given\n");
-	if (cpp_init(argv[i]))
-		die("neatcc: cannot open <%s>\n", argv[i]);
+	/* libc symbols, resolved with dlsym(), may lie anywhere */
+	farsym = run;
+	if (many && (*obj || pch_out || run))
+		die("neatcc: -b and -j cannot be used with -o, -P or -r\n");
+	if (serving && (run || jobs > 1))
+		die("neatcc: -r and -j are not supported by the server\n");
+	gettimeofday(&tv0, NULL);
+	if (many) {
+		int ret = jobs > 1 ? parallel(argv + i, argc - i, jobs, pch_in) :
+			batch(argv + i, argc - i, pch_in);
+		if (stats && jobs == 1)
+			print_stats();
+		return ret;
+	}
+	tu_init(argv[i], pch_in);
+	if (!*obj)
+		obj_name(obj, argv[i]);
+	if (!pch_out && !run && cache_get(obj)) {
+		if (stats)
+			print_stats();
+		return 0;
+	}
+	fc_init(argv[i]);
 	parse();
-	if (!*obj) {
-		strcpy(obj, argv[i]);
-		obj[strlen(obj) - 1] = 'o';
+	if (stats)
+		print_stats();
+	if (pch_out) {
+		if (!o_empty())
+			die("neatcc: <%s> generates code or data\n", argv[i]);
+		pch_save(pch_out, argv[i]);
+		return 0;
+	}
+	if (run) {
+		int (*entry)(int argc, char **argv, char **envp) = o_link("main");
+		if (!entry)
+			die("neatcc: no main() in <%s>\n", argv[i]);
+		return entry(argc - i, argv + i, environ);
+	}
+	obj_write(obj);
+	cache_put(obj);
+	fc_write();
+	return 0;
+}
+
+/*
+ * The compile server (-S) and its clients: ncc connects to the server
+ * listening on $NCC_SERVER, if any, and sends its working directory and
+ * standard error (via SCM_RIGHTS), followed by the length of its
+ * arguments and the arguments.  The server compiles them as ncc would,
+ * keeping its caches of included files, include resolution and
+ * directory listings, and replies with the exit status.  It runs one
+ * process per processor, all accepting connections on the same socket
+ * and each with its own caches, so parallel builds are not serialized.
+ * The client's
+ * environment is not sent: macros are defined only with -D options and
+ * MAKEFLAGS is read only for -j, which is always handled locally.
+ */
+static jmp_buf srv_jmp;		/* where die() returns to in the server */
+
+static void srv_die(char *msg)
+{
+	write(2, msg, strlen(msg));
+	longjmp(srv_jmp, 1);
+}
+
+/* read a request; returns its length and its descriptors in fds */
+static int srv_recv(int cfd, int *fds, char **req)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} ctl;
+	struct cmsghdr *c;
+	struct msghdr msg;
+	struct iovec iov;
+	int len = 0;
+	int nr;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	if ((nr = recvmsg(cfd, &msg, 0)) <= 0)
+		return -1;
+	c = CMSG_FIRSTHDR(&msg);
+	if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS &&
+			c->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+		memcpy(fds, CMSG_DATA(c), 2 * sizeof(int));
+	if (fds[1] < 0 || xread(cfd, (char *) &len + nr, sizeof(len) - nr) !=
+			sizeof(len) - nr || len <= 0 || len > (1 << 24))
+		return -1;
+	*req = malloc(len + 1);
+	if (xread(cfd, *req, len) != len)
+		return -1;
+	(*req)[len] = '\0';
+	return len;
+}
+
+/* handle a client connection */
+static void serve(int cfd, int err)
+{
+	char cwd[1 << 10];
+	char *req = NULL;
+	char **argv;
+	int fds[2] = {-1, -1};
+	int len = srv_recv(cfd, fds, &req);
+	int ret = 1;
+	int argc = 1;
+	int i;
+	if (len > 0 && !fchdir(fds[0]) && getcwd(cwd, sizeof(cwd))) {
+		for (i = 0; i < len; i++)
+			argc += !req[i];
+		argv = malloc((argc + 1) * sizeof(argv[0]));
+		argv[0] = "ncc";
+		argc = 1;
+		for (i = 0; i < len; i += strlen(req + i) + 1)
+			argv[argc++] = req + i;
+		argv[argc] = NULL;
+		dup2(fds[1], 2);
+		cpp_renew(cwd);
+		serving = 1;
+		die_hook = srv_die;
+		if (setjmp(srv_jmp))
+			ret = 1;
+		else
+			ret = compile(argc, argv);
+		die_hook = NULL;
+		serving = 0;
+		tu_done();
+		dup2(err, 2);
+		free(argv);
+	}
+	xwrite(cfd, &ret, sizeof(ret));
+	for (i = 0; i < 2; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	free(req);
+}
+
+/* start a server process accepting connections on fd */
+static void srv_spawn(int fd, int err)
+{
+	int ppid = getpid();
+	int pid = fork();
+	int cfd;
+	if (pid < 0)
+		die("neatcc: fork failed\n");
+	if (pid)
+		return;
+	/* exit with the process that started the pool */
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() != ppid)
+		_exit(1);
+	while (1) {
+		if ((cfd = accept(fd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			die("neatcc: accept failed\n");
+		}
+		serve(cfd, err);
+		close(cfd);
+	}
+}
+
+static int server(char *path)
+{
+	struct sockaddr_un addr;
+	int err = dup(2);
+	int n = sysconf(_SC_NPROCESSORS_ONLN);
+	int fd, i;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		die("neatcc: socket path too long <%s>\n", path);
+	signal(SIGPIPE, SIG_IGN);
+	umask(077);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (void *) &addr, sizeof(addr)) || listen(fd, 64))
+		die("neatcc: cannot listen on <%s>\n", path);
+	/* one server process per processor; each keeps its own caches */
+	for (i = 0; i < (n > 0 ? n : 1); i++)
+		srv_spawn(fd, err);
+	while (1) {
+		if (wait(NULL) > 0)
+			srv_spawn(fd, err);
+		else if (errno != EINTR)
+			die("neatcc: wait failed\n");
 	}
-	ofd = open(obj, O_WRONLY | O_TRUNC | O_CREAT, 0600);
-	o_write(ofd);
-	close(ofd);
 	return 0;
 }
 
+/* compile via the server listening on path; -1 if it is not running */
+static int client(char *path, int argc, char **argv)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} ctl;
+	struct sockaddr_un addr;
+	struct cmsghdr *c;
+	struct msghdr msg;
+	struct iovec iov;
+	struct mem req;
+	int fds[2] = {-1, 2};
+	int ret = -1;
+	int fd, i, len;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++)
+		if (strchr("rjS", argv[i][1]))
+			return -1;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(fd, (void *) &addr, sizeof(addr)) ||
+			(fds[0] = open(".", O_RDONLY)) < 0) {
+		close(fd);
+		return -1;
+	}
+	mem_init(&req);
+	mem_putz(&req, sizeof(len));
+	for (i = 1; i < argc; i++)
+		mem_put(&req, argv[i], strlen(argv[i]) + 1);
+	len = mem_len(&req) - sizeof(len);
+	mem_cpy(&req, 0, &len, sizeof(len));
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = mem_buf(&req);
+	iov.iov_len = mem_len(&req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	memcpy(CMSG_DATA(c), fds, 2 * sizeof(int));
+	i = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	if (i > 0 && xwrite(fd, (char *) mem_buf(&req) + i, mem_len(&req) - i) ==
+			mem_len(&req) - i && xread(fd, &len, sizeof(len)) == sizeof(len))
+		ret = len;
+	mem_done(&req);
+	close(fds[0]);
+	close(fd);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	char *sock = getenv("NCC_SERVER");
+	int ret;
+	if (argc > 2 && (!strcmp("-S", argv[1]) || !strcmp("--server", argv[1])))
+		return server(argv[2]);
+	if (sock && *sock && (ret = client(sock, argc, argv)) >= 0)
+		return ret;
+	return compile(argc, argv);
+}
+#endif
+
 
 /* parsing function and variable declarations */
 
@@ -1644,7 +2837,7 @@ static int basetype(struct type *type, unsigned *flags)
 	int done = 0;
 	int i = 0;
 	int isunion;
-	char name[NAMELEN] = "";
+	int name = 0;
 	*flags = 0;
 	type->flags = 0;
 	type->ptr = 0;
@@ -1684,7 +2877,7 @@ static int basetype(struct type *type, unsigned *flags)
 		case TOK_STRUCT:
 			isunion = tok_get() == TOK_UNION;
 			if (!tok_jmp(TOK_NAME))
-				strcpy(name, tok_id());
+				name = tok_id();
 			if (tok_see() == '{')
 				type->id = struct_create(name, isunion);
 			else
@@ -1704,7 +2897,7 @@ static int basetype(struct type *type, unsigned *flags)
 				int id = typedef_find(tok_id());
 				if (id != -1) {
 					tok_get();
-					memcpy(type, &typedefs[id].type,
+					memcpy(type, &typedefs[id]->type,
 						sizeof(*type));
 					return 0;
 				}
@@ -1731,7 +2924,7 @@ static void readptrs(struct type *type)
 }
 
 /* read function arguments */
-static int readargs(struct type *args, char argnames[][NAMELEN], int *varg)
+static int readargs(struct type *args, int *argnames, int *varg)
 {
 	int nargs = 0;
 	tok_expect('(');
@@ -1741,12 +2934,12 @@ static int readargs(struct type *args, char argnames[][NAMELEN], int *varg)
 			*varg = 1;
 			break;
 		}
-		if (readname(&args[nargs], argnames[nargs], NULL)) {
+		if (readname(&args[nargs], &argnames[nargs], NULL)) {
 			/* argument has no type, assume int */
 			tok_expect(TOK_NAME);
 			memset(&args[nargs], 0, sizeof(struct type));
 			args[nargs].bt = 4 | BT_SIGNED;
-			strcpy(argnames[nargs], tok_id());
+			argnames[nargs] = tok_id();
 		}
 		/* argument arrays are pointers */
 		array2ptr(&args[nargs]);
@@ -1767,7 +2960,7 @@ static void krdef(void *data, struct name *name, unsigned flags)
 	struct funcinfo *fi = data;
 	int i;
 	for (i = 0; i < fi->nargs; i++)
-		if (!strcmp(fi->argnames[i], name->name))
+		if (fi->argnames[i] == name->name)
 			memcpy(&fi->args[i], &name->type, sizeof(name->type));
 }
 
@@ -1801,7 +2994,7 @@ static struct type *readarrays(struct type *type)
 	for (i = nar - 1; i >= 0; i--) {
 		type->id = array_add(type, arsz[i]);
 		if (!inner)
-			inner = &arrays[type->id].type;
+			inner = &arrays[type->id]->type;
 		type->flags = T_ARRAY;
 		type->bt = LONGSZ;
 		type->ptr = 0;
@@ -1818,7 +3011,7 @@ static struct type *readarrays(struct type *type)
  * type of the variable.  readname() returns zero, only if the
  * variable can be read.
  */
-static int readname(struct type *main, char *name, struct type *base)
+static int readname(struct type *main, int *name, struct type *base)
 {
 	struct type tpool[3];
 	int npool = 0;
@@ -1829,7 +3022,7 @@ static int readname(struct type *main, char *name, struct type *base)
 	unsigned flags;
 	memset(tpool, 0, sizeof(tpool));
 	if (name)
-		*name = '\0';
+		*name = 0;
 	if (!base) {
 		if (basetype(type, &flags))
 			return 1;
@@ -1844,7 +3037,7 @@ static int readname(struct type *main, char *name, struct type *base)
 		readptrs(type);
 	}
 	if (!tok_jmp(TOK_NAME) && name)
-		strcpy(name, tok_id());
+		*name = tok_id();
 	inner = readarrays(type);
 	if (ptype && inner)
 		ptype = inner;
@@ -1852,7 +3045,7 @@ static int readname(struct type *main, char *name, struct type *base)
 		tok_expect(')');
 	if (tok_see() == '(') {
 		struct type args[NARGS];
-		char argnames[NARGS][NAMELEN];
+		int argnames[NARGS];
 		int varg = 0;
 		int nargs = readargs(args, argnames, &varg);
 		if (!ptype) {
@@ -1862,9 +3055,10 @@ static int readname(struct type *main, char *name, struct type *base)
 		}
 		ptype->flags = T_FUNC;
 		ptype->bt = LONGSZ;
-		ptype->id = func_create(btype, name, argnames, args, nargs, varg);
+		ptype->id = func_create(btype, name ? *name : 0, argnames,
+					args, nargs, varg);
 		if (tok_see() != ';')
-			while (tok_see() != '{' && !readdefs(krdef, &funcs[ptype->id]))
+			while (tok_see() != '{' && !readdefs(krdef, funcs[ptype->id]))
 				tok_expect(';');
 	} else {
 		if (ptype && readarrays(type))
@@ -1898,8 +3092,8 @@ static int readdefs(void (*def)(void *data, struct name *name, unsigned flags),
 	if (tok_see() == ';' || tok_see() == '{')
 		return 0;
 	do {
-		struct name name = {{""}};
-		if (readname(&name.type, name.name, &base))
+		struct name name = {0};
+		if (readname(&name.type, &name.name, &base))
 			break;
 		def(data, &name, base_flags);
 	} while (!tok_jmp(','));
@@ -1920,8 +3114,8 @@ static int readdefs_int(void (*def)(void *data, struct name *name, unsigned flag
 	}
 	if (tok_see() != ';') {
 		do {
-			struct name name = {{""}};
-			if (readname(&name.type, name.name, &base))
+			struct name name = {0};
+			if (readname(&name.type, &name.name, &base))
 				break;
 			def(data, &name, flags);
 		} while (!tok_jmp(','));
@@ -1948,6 +3142,7 @@ static int initsize(void)
 	int n = 0;
 	if (tok_jmp('='))
 		return 0;
+	tok_keep(addr);
 	if (!tok_jmp(TOK_STR)) {
 		tok_str(NULL, &n);
 		tok_jump(addr);
@@ -1977,7 +3172,7 @@ static int initsize(void)
 static struct type *innertype(struct type *t)
 {
 	if (t->flags & T_ARRAY && !t->ptr)
-		return innertype(&arrays[t->id].type);
+		return innertype(&arrays[t->id]->type);
 	return t;
 }
 
@@ -1990,7 +3185,7 @@ static void initexpr(struct type *t, int off, void *obj,
 		return;
 	}
 	if (!t->ptr && t->flags & T_STRUCT) {
-		struct structinfo *si = &structs[t->id];
+		struct structinfo *si = structs[t->id];
 		int i;
 		for (i = 0; i < si->nfields && tok_see() != '}'; i++) {
 			struct name *field = &si->fields[i];
@@ -2004,7 +3199,7 @@ static void initexpr(struct type *t, int off, void *obj,
 				break;
 		}
 	} else if (t->flags & T_ARRAY) {
-		struct type *t_de = &arrays[t->id].type;
+		struct type *t_de = &arrays[t->id]->type;
 		int i;
 		/* handling extra braces as in: char s[] = {"sth"} */
 		if (TYPE_SZ(t_de) == 1 && tok_see() == TOK_STR) {
@@ -13,43 +13,24 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include "mem.h"
 #include "tok.h"
 
-#define OBUFSZ		(1 << 19)
+#define OBUFSZ		(1 << 16)
 
-static int rmcomments(char *d, char *s, int l)
-{
-	char *e = s + l;
-	char *d1 = d;
-	char *r = s;
-	while (r < e) {
-		if (r + 3 < e && r[0] == '/' && r[1] == '*') {
-			memcpy(d, s, r - s);
-			d += r - s;
-			while (r + 1 < e) {
-				r++;
-				if (r[0] == '*' && r[1] == '/') {
-					r++;
-					break;
-				}
-			}
-			s = r + 1;
-		}
-		if (r + 1 < e && (r[0] == '\'' || r[0] == '"')) {
-			char c = r[0];
-			r++;
-			while (r < e && *r != c) {
-				if (*r == '\\')
-					r++;
-				r++;
-			}
-		}
-		r++;
-	}
-	memcpy(d, s, e - s);
-	d += e - s;
-	return d - d1;
-}
+/* comment removal states */
+#define S_CODE		0
+#define S_SLASH		1	/* after a '/' ending the previous hunk */
+#define S_QUOTE		2	/* in a string or character literal */
+#define S_ESC		3	/* after a backslash in a literal */
+#define S_COMMENT	4	/* in a comment */
+#define S_STAR		5	/* after a '*' in a comment */
+
+static char obuf[OBUFSZ];	/* output buffer */
+static int olen;		/* bytes in obuf[] */
+static int ofd;			/* output file */
+static int state;		/* comment removal state */
+static int quote;		/* the quote character of the current literal */
 
 static int xwrite(int fd, char *buf, int len)
 {
@@ -65,6 +46,85 @@ static int xwrite(int fd, char *buf, int len)
 	return nw;
 }
 
+static void oflush(void)
+{
+	if (xwrite(ofd, obuf, olen) < olen)
+		die("npp: write failed\n");
+	olen = 0;
+}
+
+static void oput(char *s, int n)
+{
+	if (olen + n > OBUFSZ)
+		oflush();
+	if (n > OBUFSZ) {
+		if (xwrite(ofd, s, n) < n)
+			die("npp: write failed\n");
+		return;
+	}
+	memcpy(obuf + olen, s, n);
+	olen += n;
+}
+
+/* write a hunk of cpp_read() output without its comments */
+static void rmcomments(char *s, int l)
+{
+	char *e = s + l;
+	char *r = s;
+	if (state == S_SLASH) {
+		state = S_CODE;
+		if (r < e && *r == '*') {
+			state = S_COMMENT;
+			r++;
+		} else {
+			oput("/", 1);
+		}
+	}
+	for (; r < e; r++) {
+		switch (state) {
+		case S_CODE:
+			if (*r == '/' && r + 1 == e) {
+				oput(s, r - s);
+				state = S_SLASH;
+				return;
+			}
+			if (*r == '/' && r[1] == '*') {
+				oput(s, r - s);
+				state = S_COMMENT;
+				r++;
+			}
+			if (*r == '"' || *r == '\'') {
+				quote = *r;
+				state = S_QUOTE;
+			}
+			break;
+		case S_QUOTE:
+			if (*r == '\\')
+				state = S_ESC;
+			else if (*r == quote)
+				state = S_CODE;
+			break;
+		case S_ESC:
+			state = S_QUOTE;
+			break;
+		case S_COMMENT:
+			if (*r == '*')
+				state = S_STAR;
+			break;
+		case S_STAR:
+			if (*r == '/') {
+				state = S_CODE;
+				s = r + 1;
+			} else if (*r != '*') {
+				state = S_COMMENT;
+			}
+			break;
+		}
+	}
+	if (state < S_COMMENT)
+		oput(s, e - s);
+}
+
 void err(char *fmt, ...)
 {
 	va_list ap;
@@ -77,10 +137,7 @@ void err(char *fmt, ...)
 
 int main(int argc, char *argv[])
 {
-	int ofd = 1;
 	int i = 1;
-	char *s1, *s2;
-	int len = 0;
 	char *cbuf;
 	int clen;
 	while (i < argc && argv[i][0] == '-') {
@@ -107,16 +164,11 @@ int main(int argc, char *argv[])
 	ofd = open(argv[i++], O_WRONLY | O_TRUNC | O_CREAT, 0600);
 	if (ofd < 0)
 		die("npp: cannot open <%s>\n", argv[i - 1]);
-	s1 = malloc(OBUFSZ);
-	s2 = malloc(OBUFSZ);
-	if (!s1 || !s2)
-		die("npp: cannot allocate enough memory\n");
-	while (!cpp_read(&cbuf, &clen)) {
-		memcpy(s1 + len, cbuf, clen);
-		len += clen;
-	}
-	len = rmcomments(s2, s1, len);
-	xwrite(ofd, s2, len);
+	while (!cpp_read(&cbuf, &clen))
+		rmcomments(cbuf, clen);
+	if (state == S_SLASH)
+		oput("/", 1);
+	oflush();
 	close(ofd);
 	return 0;
 }
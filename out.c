@@ -1,10 +1,17 @@
 /* neatcc ELF object generation */
+#include <dlfcn.h>
 #include <elf.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include "gen.h"
+#include "mem.h"
 #include "ncc.h"
 #include "out.h"
+#include "tab.h"
 
 #define ALIGN(x, a)		(((x) + (a) - 1) & ~((a) - 1))
 
@@ -42,49 +49,105 @@
 #  define ELF_R_INFO	ELF32_R_INFO
 #endif
 
+#define OUTSZ			256	/* initial symbol and relocation slots */
+
+/* out_link() call stubs for far functions */
+#ifdef NEATCC_X64
+#  define STUBSZ	14
+#  define STUBREL	R_X86_64_PC32
+#endif
+#ifdef NEATCC_X86
+#  define STUBSZ	0
+#  define STUBREL	-1
+#endif
+#ifdef NEATCC_ARM
+#  define STUBSZ	8
+#  define STUBREL	R_ARM_PC24
+#endif
+
 static Elf_Ehdr ehdr;
 static Elf_Shdr shdr[NSECS];
-static Elf_Sym syms[NSYMS];
-static int nsyms = 1;
-static char symstr[NSYMS * 8];
-static int nsymstr = 1;
-
-static Elf_Rel dsrels[NRELS];
+static Elf_Sym *syms;
+static int nsyms;
+static int szsyms;
+static struct tab symtab;	/* symbol index; entry i is syms[i] */
+static struct mem symstr;
+static struct tab strtab;	/* symstr[] index */
+static int *stroff;		/* the offset of strtab entries in symstr[] */
+static int szstroff;
+
+static Elf_Rel *dsrels;
 static int ndsrels;
-static Elf_Rel rels[NRELS];
+static int szdsrels;
+static Elf_Rel *rels;
 static int nrels;
+static int szrels;
+static struct mem *orec;	/* out_sym() and out_rel() calls are logged here */
+static long orec_beg[3];	/* cs, ds and bss offsets when logging started */
 
 void err(char *msg, ...);
+void die(char *msg, ...);
 static int rel_type(int flags);
 static void ehdr_init(Elf_Ehdr *ehdr);
+static int rel_apply(int type, char *p, unsigned long s);
+static void stub_put(char *p, unsigned long addr);
+
+/* make room for entry n of a growable array */
+static void *out_grow(void *a, int *sz, int n, int isz)
+{
+	if (n < *sz)
+		return a;
+	*sz = *sz ? *sz * 2 : OUTSZ;
+	a = realloc(a, *sz * isz);
+	if (!a)
+		err("nomem: out of memory!\n");
+	return a;
+}
 
 static int symstr_add(char *name)
 {
-	int len = strlen(name) + 1;
-	if (nsymstr + len >= sizeof(symstr))
-		err("nomem: NSYMS reached!\n");
-	strcpy(symstr + nsymstr, name);
-	nsymstr += len;
-	return nsymstr - len;
+	int i;
+	for (i = tab_find(&strtab, name); i >= 0; i = tab_next(&strtab, i))
+		if (!strcmp(name, (char *) mem_buf(&symstr) + stroff[i]))
+			return stroff[i];
+	if (!mem_len(&symstr))
+		mem_putc(&symstr, '\0');
+	stroff = out_grow(stroff, &szstroff, strtab.n, sizeof(stroff[0]));
+	i = tab_add(&strtab, name);
+	stroff[i] = mem_len(&symstr);
+	mem_put(&symstr, name, strlen(name) + 1);
+	return stroff[i];
+}
+
+static Elf_Sym *sym_new(char *name)
+{
+	Elf_Sym *sym;
+	syms = out_grow(syms, &szsyms, nsyms, sizeof(syms[0]));
+	sym = &syms[nsyms++];
+	memset(sym, 0, sizeof(*sym));
+	tab_add(&symtab, name);
+	return sym;
 }
 
 static int sym_find(char *name)
 {
 	int i;
-	for (i = 0; i < nsyms; i++)
-		if (!strcmp(name, symstr + syms[i].st_name))
+	for (i = tab_find(&symtab, name); i >= 0; i = tab_next(&symtab, i))
+		if (!strcmp(name, (char *) mem_buf(&symstr) + syms[i].st_name))
 			return i;
 	return -1;
 }
 
 static Elf_Sym *put_sym(char *name)
 {
-	int found = sym_find(name);
-	Elf_Sym *sym = found != -1 ? &syms[found] : &syms[nsyms++];
+	int found;
+	Elf_Sym *sym;
+	if (!nsyms)
+		sym_new("");		/* the null symbol */
+	found = sym_find(name);
 	if (found >= 0)
-		return sym;
-	if (nsyms >= NSYMS)
-		err("nomem: NSYMS reached!\n");
+		return &syms[found];
+	sym = sym_new(name);
 	sym->st_name = symstr_add(name);
 	sym->st_shndx = SHN_UNDEF;
 	sym->st_info = ELF_ST_INFO(STB_GLOBAL, STT_FUNC);
@@ -105,7 +168,7 @@ static void mvrela(int *mv, Elf_Rel *rels, int nrels)
 
 static int syms_sort(void)
 {
-	int mv[NSYMS];
+	int *mv = malloc(nsyms * sizeof(mv[0]));
 	int i, j;
 	int glob_beg = 1;
 	for (i = 0; i < nsyms; i++)
@@ -129,6 +192,7 @@ static int syms_sort(void)
 	glob_beg = j + 1;
 	mvrela(mv, rels, nrels);
 	mvrela(mv, dsrels, ndsrels);
+	free(mv);
 	return glob_beg;
 }
 
@@ -136,11 +200,81 @@ void out_init(int flags)
 {
 }
 
+/* the start of the section of flags in beg[] */
+static long sec_beg(long *beg, int flags)
+{
+	if (flags & OUT_DS)
+		return beg[1];
+	return flags & OUT_BSS ? beg[2] : beg[0];
+}
+
+/* log a call; len is negative for out_rel() */
+static void orec_put(char *name, int flags, int off, int len)
+{
+	int h[3] = {flags, off - sec_beg(orec_beg, flags), len};
+	mem_put(orec, h, sizeof(h));
+	mem_put(orec, name, strlen(name) + 1);
+}
+
+/* log the calls to mem (none if NULL) with offsets relative to cs, ds and bss */
+void out_rec(struct mem *mem, long cs, long ds, long bss)
+{
+	orec = mem;
+	orec_beg[0] = cs;
+	orec_beg[1] = ds;
+	orec_beg[2] = bss;
+}
+
+/* repeat the calls logged by out_rec(); sym() may rename the symbols */
+void out_replay(char *log, int len, long cs, long ds, long bss,
+		char *(*sym)(char *name))
+{
+	long beg[3] = {cs, ds, bss};
+	char *end = log + len;
+	while (log < end) {
+		int h[3];
+		char *name;
+		memcpy(h, log, sizeof(h));
+		log += sizeof(h);
+		name = sym(log);
+		log += strlen(log) + 1;
+		if (h[2] < 0)
+			out_rel(name, h[0], h[1] + sec_beg(beg, h[0]));
+		else
+			out_sym(name, h[0], h[1] + sec_beg(beg, h[0]), h[2]);
+	}
+}
+
+/* check a log of out_rec() whose sections hold cs, ds and bss bytes */
+int out_rcheck(char *log, int len, long cs, long ds, long bss)
+{
+	long sz[3] = {cs, ds, bss};
+	char *end = log + len;
+	while (log < end) {
+		int h[3];
+		int w = 0;
+		if (end - log < sizeof(h))
+			return 1;
+		memcpy(h, log, sizeof(h));
+		log += sizeof(h);
+		if (!memchr(log, '\0', end - log))
+			return 1;
+		log += strlen(log) + 1;
+		if (h[2] < 0)
+			w = h[0] & (OUT_RLREL | OUT_RL24 | OUT_RL32) ? 4 : LONGSZ;
+		if (h[1] < 0 || h[1] + w > sec_beg(sz, h[0]))
+			return 1;
+	}
+	return 0;
+}
+
 void out_sym(char *name, int flags, int off, int len)
 {
 	Elf_Sym *sym = put_sym(name);
 	int type = (flags & OUT_CS) ? STT_FUNC : STT_OBJECT;
 	int bind = (flags & OUT_GLOB) ? STB_GLOBAL : STB_LOCAL;
+	if (orec)
+		orec_put(name, flags, off, len);
 	if (flags & OUT_CS)
 		sym->st_shndx = SEC_TEXT;
 	if (flags & OUT_DS)
@@ -154,18 +288,20 @@ void out_sym(char *name, int flags, int off, int len)
 
 static void out_csrel(int idx, int off, int flags)
 {
-	Elf_Rel *r = &rels[nrels++];
-	if (nrels >= NRELS)
-		err("nomem: NRELS reached!\n");
+	Elf_Rel *r;
+	rels = out_grow(rels, &szrels, nrels, sizeof(rels[0]));
+	r = &rels[nrels++];
+	memset(r, 0, sizeof(*r));
 	r->r_offset = off;
 	r->r_info = ELF_R_INFO(idx, rel_type(flags));
 }
 
 static void out_dsrel(int idx, int off, int flags)
 {
-	Elf_Rel *r = &dsrels[ndsrels++];
-	if (ndsrels >= NRELS)
-		err("nomem: NRELS reached!\n");
+	Elf_Rel *r;
+	dsrels = out_grow(dsrels, &szdsrels, ndsrels, sizeof(dsrels[0]));
+	r = &dsrels[ndsrels++];
+	memset(r, 0, sizeof(*r));
 	r->r_offset = off;
 	r->r_info = ELF_R_INFO(idx, rel_type(flags));
 }
@@ -174,6 +310,8 @@ void out_rel(char *name, int flags, int off)
 {
 	Elf_Sym *sym = put_sym(name);
 	int idx = sym - syms;
+	if (orec)
+		orec_put(name, flags, off, -1);
 	if (flags & OUT_DS)
 		out_dsrel(idx, off, flags);
 	else
@@ -193,8 +331,39 @@ static int bss_len(void)
 	return len;
 }
 
-void out_write(int fd, char *cs, int cslen, char *ds, int dslen)
+/* write all of iov[]; returns nonzero on failure */
+static int xwritev(int fd, struct iovec *iov, int n)
+{
+	while (n > 0) {
+		long nw = writev(fd, iov, n);
+		if (nw < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (nw <= 0)
+			return 1;
+		while (n > 0 && nw >= iov->iov_len) {
+			nw -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *) iov->iov_base + nw;
+			iov->iov_len -= nw;
+		}
+	}
+	return 0;
+}
+
+static struct iovec *iov_set(struct iovec *v, void *buf, long len)
 {
+	v->iov_base = buf;
+	v->iov_len = len;
+	return v + 1;
+}
+
+/* lay out the object file in iov[]; returns the number of its parts */
+static int out_iov(struct iovec *iov, char *cs, int cslen, char *ds, int dslen)
+{
+	struct iovec *v = iov;
 	Elf_Shdr *text_shdr = &shdr[SEC_TEXT];
 	Elf_Shdr *rela_shdr = &shdr[SEC_REL];
 	Elf_Shdr *symstr_shdr = &shdr[SEC_SYMSTR];
@@ -203,6 +372,8 @@ void out_write(int fd, char *cs, int cslen, char *ds, int dslen)
 	Elf_Shdr *datrel_shdr = &shdr[SEC_DATREL];
 	Elf_Shdr *bss_shdr = &shdr[SEC_BSS];
 	unsigned long offset = sizeof(ehdr);
+	if (!nsyms)
+		sym_new("");
 
 	/* workaround for the idiotic gnuld; use neatld instead! */
 	text_shdr->sh_name = symstr_add(".cs");
@@ -276,18 +447,147 @@ void out_write(int fd, char *cs, int cslen, char *ds, int dslen)
 
 	symstr_shdr->sh_type = SHT_STRTAB;
 	symstr_shdr->sh_offset = offset;
-	symstr_shdr->sh_size = nsymstr;
+	symstr_shdr->sh_size = mem_len(&symstr);
 	symstr_shdr->sh_entsize = 1;
 	offset += symstr_shdr->sh_size;
 
-	write(fd, &ehdr, sizeof(ehdr));
-	write(fd, shdr,  NSECS * sizeof(shdr[0]));
-	write(fd, cs, cslen);
-	write(fd, rels, nrels * sizeof(rels[0]));
-	write(fd, syms, nsyms * sizeof(syms[0]));
-	write(fd, ds, dslen);
-	write(fd, dsrels, ndsrels * sizeof(dsrels[0]));
-	write(fd, symstr, nsymstr);
+	v = iov_set(v, &ehdr, sizeof(ehdr));
+	v = iov_set(v, shdr, NSECS * sizeof(shdr[0]));
+	v = iov_set(v, cs, cslen);
+	v = iov_set(v, rels, nrels * sizeof(rels[0]));
+	v = iov_set(v, syms, nsyms * sizeof(syms[0]));
+	v = iov_set(v, ds, dslen);
+	v = iov_set(v, dsrels, ndsrels * sizeof(dsrels[0]));
+	v = iov_set(v, mem_buf(&symstr), mem_len(&symstr));
+	return v - iov;
+}
+
+/* write the object file; returns nonzero on failure */
+int out_write(int fd, char *cs, int cslen, char *ds, int dslen)
+{
+	struct iovec iov[8];
+	int n = out_iov(iov, cs, cslen, ds, dslen);
+	return xwritev(fd, iov, n);
+}
+
+/* append the object file to mem */
+void out_mem(struct mem *mem, char *cs, int cslen, char *ds, int dslen)
+{
+	struct iovec iov[8];
+	int n = out_iov(iov, cs, cslen, ds, dslen);
+	int i;
+	for (i = 0; i < n; i++)
+		mem_put(mem, iov[i].iov_base, iov[i].iov_len);
+}
+
+/* release the symbols and relocations; the next object may start */
+void out_done(void)
+{
+	free(syms);
+	syms = NULL;
+	nsyms = 0;
+	szsyms = 0;
+	tab_done(&symtab);
+	mem_done(&symstr);
+	tab_done(&strtab);
+	free(stroff);
+	stroff = NULL;
+	szstroff = 0;
+	free(rels);
+	rels = NULL;
+	nrels = 0;
+	szrels = 0;
+	free(dsrels);
+	dsrels = NULL;
+	ndsrels = 0;
+	szdsrels = 0;
+	orec = NULL;
+	memset(&ehdr, 0, sizeof(ehdr));
+	memset(shdr, 0, sizeof(shdr));
+}
+
+/* relocate r against the symbol addresses in addr[] */
+static void load_rel(Elf_Rel *r, char *base, unsigned long *addr,
+		unsigned long *stubs, char **stub)
+{
+	int sym = ELF_R_SYM(r->r_info);
+	int type = ELF_R_TYPE(r->r_info);
+	char *p = base + r->r_offset;
+	if (!rel_apply(type, p, addr[sym]))
+		return;
+	/* a call to a far symbol; jump through a stub */
+	if (type == STUBREL && syms[sym].st_shndx == SHN_UNDEF) {
+		if (!stubs[sym]) {
+			stub_put(*stub, addr[sym]);
+			stubs[sym] = (unsigned long) *stub;
+			*stub += STUBSZ;
+		}
+		if (!rel_apply(type, p, stubs[sym]))
+			return;
+	}
+	die("neatcc: relocation out of range for <%s>\n",
+		(char *) mem_buf(&symstr) + syms[sym].st_name);
+}
+
+/*
+ * link the object in memory and return the address of name
+ *
+ * Code and data are mapped, relocated against their mapped addresses
+ * and against the symbols of the running process, and the code pages
+ * are made executable.  Returns NULL if name is not a defined function.
+ */
+void *out_link(char *cs, int cslen, char *ds, int dslen, char *name)
+{
+	long pgsz = sysconf(_SC_PAGESIZE);
+	long csz, dsz;
+	unsigned long *addr, *stubs;
+	char *img, *stub;
+	void *self = dlopen(NULL, RTLD_NOW);
+	void *ret = NULL;
+	int i;
+	if (!nsyms)
+		sym_new("");
+	csz = ALIGN(cslen + nsyms * STUBSZ, pgsz);
+	dsz = ALIGN(dslen, OUT_ALIGNMENT) + bss_len();
+	img = mmap(NULL, csz + dsz + 1, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (img == MAP_FAILED)
+		die("neatcc: cannot map the code\n");
+	memcpy(img, cs, cslen);
+	memcpy(img + csz, ds, dslen);
+	addr = calloc(nsyms, sizeof(addr[0]));
+	stubs = calloc(nsyms, sizeof(stubs[0]));
+	for (i = 1; i < nsyms; i++) {
+		char *s = (char *) mem_buf(&symstr) + syms[i].st_name;
+		unsigned long off = syms[i].st_value;
+		if (syms[i].st_shndx == SEC_TEXT)
+			addr[i] = (unsigned long) img + off;
+		if (syms[i].st_shndx == SEC_DAT)
+			addr[i] = (unsigned long) img + csz + off;
+		if (syms[i].st_shndx == SEC_BSS)
+			addr[i] = (unsigned long) img + csz +
+				ALIGN(dslen, OUT_ALIGNMENT) + off;
+		if (syms[i].st_shndx == SHN_UNDEF) {
+			addr[i] = self ? (unsigned long) dlsym(self, s) : 0;
+			if (!addr[i])
+				die("neatcc: undefined symbol <%s>\n", s);
+		}
+	}
+	if (self)
+		dlclose(self);
+	stub = img + cslen;
+	for (i = 0; i < nrels; i++)
+		load_rel(&rels[i], img, addr, stubs, &stub);
+	for (i = 0; i < ndsrels; i++)
+		load_rel(&dsrels[i], img + csz, addr, stubs, &stub);
+	if (mprotect(img, csz, PROT_READ | PROT_EXEC))
+		die("neatcc: cannot make the code executable\n");
+	i = sym_find(name);
+	if (i > 0 && syms[i].st_shndx == SEC_TEXT)
+		ret = (void *) addr[i];
+	free(addr);
+	free(stubs);
+	return ret;
 }
 
 /* architecture dependent functions */
@@ -306,6 +606,31 @@ static int rel_type(int flags)
 	return flags & OUT_RLREL ? R_ARM_REL32 : R_ARM_ABS32;
 
 }
+
+/* apply a relocation with an inline addend; nonzero if out of range */
+static int rel_apply(int type, char *p, unsigned long s)
+{
+	unsigned int w;
+	long v;
+	memcpy(&w, p, 4);
+	if (type == R_ARM_PC24) {
+		v = s + (((int) (w << 8)) >> 6) - (unsigned long) p;
+		if (v < -(1l << 25) || v >= (1l << 25))
+			return 1;
+		w = (w & 0xff000000) | ((v >> 2) & 0x00ffffff);
+	} else {
+		w += type == R_ARM_REL32 ? s - (unsigned long) p : s;
+	}
+	memcpy(p, &w, 4);
+	return 0;
+}
+
+/* ldr pc, [pc, #-4]; .word addr */
+static void stub_put(char *p, unsigned long addr)
+{
+	unsigned int w[2] = {0xe51ff004, addr};
+	memcpy(p, w, 8);
+}
 #endif
 
 #ifdef NEATCC_X64
@@ -322,6 +647,35 @@ static int rel_type(int flags)
 		return flags & OUT_RLSX ? R_X86_64_32S : R_X86_64_32;
 	return R_X86_64_64;
 }
+
+/* apply a relocation with an inline addend; nonzero if out of range */
+static int rel_apply(int type, char *p, unsigned long s)
+{
+	int a;
+	long v;
+	if (type == R_X86_64_64) {
+		memcpy(&v, p, 8);
+		v += s;
+		memcpy(p, &v, 8);
+		return 0;
+	}
+	memcpy(&a, p, 4);
+	v = s + a;
+	if (type == R_X86_64_PC32)
+		v -= (unsigned long) p;
+	if (type == R_X86_64_32 ? v != (unsigned int) v : v != (int) v)
+		return 1;
+	a = v;
+	memcpy(p, &a, 4);
+	return 0;
+}
+
+/* jmp *0(%rip); .quad addr */
+static void stub_put(char *p, unsigned long addr)
+{
+	memcpy(p, "\xff\x25\x00\x00\x00\x00", 6);
+	memcpy(p + 6, &addr, 8);
+}
 #endif
 
 #ifdef NEATCC_X86
@@ -334,4 +688,18 @@ static int rel_type(int flags)
 {
 	return flags & OUT_RLREL ? R_386_PC32 : R_386_32;
 }
+
+/* apply a relocation with an inline addend */
+static int rel_apply(int type, char *p, unsigned long s)
+{
+	unsigned int w;
+	memcpy(&w, p, 4);
+	w += type == R_386_PC32 ? s - (unsigned long) p : s;
+	memcpy(p, &w, 4);
+	return 0;
+}
+
+static void stub_put(char *p, unsigned long addr)
+{
+}
 #endif
@@ -17,4 +17,14 @@ void out_init(int flags);
 void out_sym(char *name, int flags, int off, int len);
 void out_rel(char *name, int flags, int off);
 
-void out_write(int fd, char *cs, int cslen, char *ds, int dslen);
+struct mem;
+
+void out_rec(struct mem *mem, long cs, long ds, long bss);
+void out_replay(char *log, int len, long cs, long ds, long bss,
+		char *(*sym)(char *name));
+int out_rcheck(char *log, int len, long cs, long ds, long bss);
+
+int out_write(int fd, char *cs, int cslen, char *ds, int dslen);
+void out_mem(struct mem *mem, char *cs, int cslen, char *ds, int dslen);
+void out_done(void);
+void *out_link(char *cs, int cslen, char *ds, int dslen, char *name);
@@ -0,0 +1,296 @@
+/*
+ * hash tables for finding names
+ *
+ * The entries of a tab are numbered in the order they are added,
+ * matching the index of the item they describe in the caller's array.
+ * tab_find() returns the last added entry with the given key and
+ * tab_next() the one added before it; since the caller compares the
+ * keys, the later definitions of a name hide the earlier ones.
+ * tab_pop() removes the entries added after a point, which is how
+ * the parser drops the names defined in a block at its end.
+ *
+ * The tables of the parser are keyed on atoms instead: interned
+ * strings, numbered in the order they are first seen.  The atom
+ * itself serves as the hash of tab_addi() and tab_findi() entries;
+ * since no two atoms are equal, their callers need not compare keys.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tab.h"
+
+#define TABSZ		64	/* initial number of heads and entries */
+#define POOLSZ		(1 << 14)	/* atom string pool size */
+
+static unsigned tab_hash(char *s)
+{
+	unsigned h = 2166136261u;
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+static void tab_link(struct tab *t, int i)
+{
+	int h = t->hash[i] & (t->nhead - 1);
+	t->next[i] = t->head[h];
+	t->head[h] = i;
+}
+
+static void tab_rehash(struct tab *t, int nhead)
+{
+	int i;
+	free(t->head);
+	t->head = malloc(nhead * sizeof(t->head[0]));
+	memset(t->head, 0xff, nhead * sizeof(t->head[0]));
+	t->nhead = nhead;
+	for (i = 0; i < t->n; i++)
+		tab_link(t, i);
+}
+
+void tab_done(struct tab *t)
+{
+	free(t->head);
+	free(t->next);
+	free(t->hash);
+	memset(t, 0, sizeof(*t));
+}
+
+static int tab_put(struct tab *t, unsigned hash)
+{
+	int i = t->n;
+	if (t->n == t->sz) {
+		t->sz = t->sz ? t->sz + t->sz : TABSZ;
+		t->next = realloc(t->next, t->sz * sizeof(t->next[0]));
+		t->hash = realloc(t->hash, t->sz * sizeof(t->hash[0]));
+	}
+	t->hash[i] = hash;
+	t->n++;
+	if (t->n > t->nhead * 2)
+		tab_rehash(t, t->nhead ? t->nhead * 4 : TABSZ);
+	else
+		tab_link(t, i);
+	return i;
+}
+
+/* add an entry for key; returns its index */
+int tab_add(struct tab *t, char *key)
+{
+	return tab_put(t, tab_hash(key));
+}
+
+/* add an entry for the given atom; returns its index */
+int tab_addi(struct tab *t, int key)
+{
+	return tab_put(t, key);
+}
+
+/* remove the entries added after the first n */
+void tab_pop(struct tab *t, int n)
+{
+	while (t->n > n) {
+		int i = --t->n;
+		t->head[t->hash[i] & (t->nhead - 1)] = t->next[i];
+	}
+}
+
+static int tab_skip(struct tab *t, int i, unsigned h)
+{
+	while (i >= 0 && t->hash[i] != h)
+		i = t->next[i];
+	return i;
+}
+
+static int tab_get(struct tab *t, unsigned h)
+{
+	if (!t->n)
+		return -1;
+	return tab_skip(t, t->head[h & (t->nhead - 1)], h);
+}
+
+/* the last entry that may match key or -1 */
+int tab_find(struct tab *t, char *key)
+{
+	return tab_get(t, tab_hash(key));
+}
+
+/* the last entry added for the given atom or -1 */
+int tab_findi(struct tab *t, int key)
+{
+	return tab_get(t, key);
+}
+
+/* the entry before i that may match the same key or -1 */
+int tab_next(struct tab *t, int i)
+{
+	return tab_skip(t, t->next[i], t->hash[i]);
+}
+
+static struct tab atab;		/* atoms hash table */
+static char **atoms;		/* atom strings */
+static int natoms;
+static int szatoms;
+static char *pool;		/* the free part of the string pool */
+static int poolleft;
+static char **pools;		/* the last pool block; linked via its head */
+
+static char *atom_dup(char *s)
+{
+	int n = strlen(s) + 1;
+	char *d;
+	if (n > poolleft) {
+		char **blk;
+		poolleft = n > POOLSZ ? n : POOLSZ;
+		blk = malloc(sizeof(*blk) + poolleft);
+		blk[0] = (char *) pools;
+		pools = blk;
+		pool = (char *) (blk + 1);
+	}
+	d = pool;
+	memcpy(d, s, n);
+	pool += n;
+	poolleft -= n;
+	return d;
+}
+
+/* the atom of s; the empty string is atom zero */
+int atom(char *s)
+{
+	int i;
+	if (!natoms && *s)
+		atom("");
+	for (i = tab_find(&atab, s); i >= 0; i = tab_next(&atab, i))
+		if (!strcmp(atoms[i], s))
+			return i;
+	if (natoms == szatoms) {
+		szatoms = szatoms ? szatoms + szatoms : TABSZ;
+		atoms = realloc(atoms, szatoms * sizeof(atoms[0]));
+	}
+	atoms[natoms] = atom_dup(s);
+	tab_add(&atab, s);
+	return natoms++;
+}
+
+/* the string of an atom */
+char *atom_name(int id)
+{
+	return id < natoms ? atoms[id] : "";
+}
+
+/* the number of atoms */
+int atom_count(void)
+{
+	return natoms;
+}
+
+/* forget all atoms */
+void atom_done(void)
+{
+	while (pools) {
+		char **blk = pools;
+		pools = (char **) blk[0];
+		free(blk);
+	}
+	pool = NULL;
+	poolleft = 0;
+	free(atoms);
+	atoms = NULL;
+	natoms = 0;
+	szatoms = 0;
+	tab_done(&atab);
+}
+
+/*
+ * content hashes: MurmurHash3 (x86, 128-bit) fed incrementally; only
+ * 32-bit arithmetic is used, so that neatcc can compile it for any
+ * of its targets
+ */
+#define ROTL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+static unsigned hsh_c[4] = {0x239b961b, 0xab0e9789, 0x38b34ae5, 0xa1e38b93};
+static unsigned hsh_n[4] = {0x561ccd1b, 0x0bcaa747, 0x96cd1c35, 0x32ac3b17};
+static int hsh_r[4] = {15, 16, 17, 18};		/* key rotations */
+static int hsh_s[4] = {19, 17, 15, 13};		/* state rotations */
+
+void hsh_init(struct hsh *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+/* mix word k into lane i */
+static unsigned hsh_k(int i, unsigned k)
+{
+	k *= hsh_c[i];
+	k = ROTL(k, hsh_r[i]);
+	return k * hsh_c[(i + 1) & 3];
+}
+
+static void hsh_blk(struct hsh *h, unsigned char *b)
+{
+	int i;
+	for (i = 0; i < 4; i++) {
+		unsigned k = b[i * 4] | (b[i * 4 + 1] << 8) |
+			(b[i * 4 + 2] << 16) | ((unsigned) b[i * 4 + 3] << 24);
+		h->h[i] ^= hsh_k(i, k);
+		h->h[i] = ROTL(h->h[i], hsh_s[i]);
+		h->h[i] += h->h[(i + 1) & 3];
+		h->h[i] = h->h[i] * 5 + hsh_n[i];
+	}
+}
+
+void hsh_put(struct hsh *h, void *buf, int len)
+{
+	unsigned char *s = buf;
+	h->len += len;
+	if (h->nblk) {
+		int n = 16 - h->nblk < len ? 16 - h->nblk : len;
+		memcpy(h->blk + h->nblk, s, n);
+		h->nblk += n;
+		s += n;
+		len -= n;
+		if (h->nblk < 16)
+			return;
+		hsh_blk(h, h->blk);
+		h->nblk = 0;
+	}
+	for (; len >= 16; len -= 16, s += 16)
+		hsh_blk(h, s);
+	memcpy(h->blk, s, len);
+	h->nblk = len;
+}
+
+static unsigned hsh_fmix(unsigned k)
+{
+	k ^= k >> 16;
+	k *= 0x85ebca6b;
+	k ^= k >> 13;
+	k *= 0xc2b2ae35;
+	return k ^ (k >> 16);
+}
+
+/* write the hash of the data given to hsh_put() to s in hex */
+void hsh_hex(struct hsh *h, char *s)
+{
+	unsigned r[4];
+	int i, j;
+	for (i = 0; i < 4; i++) {
+		unsigned k = 0;
+		for (j = 3; j >= 0; j--)
+			if (i * 4 + j < h->nblk)
+				k = (k << 8) | h->blk[i * 4 + j];
+		r[i] = h->h[i] ^ (i * 4 < h->nblk ? hsh_k(i, k) : 0);
+		r[i] ^= h->len;
+	}
+	for (i = 1; i < 4; i++)
+		r[0] += r[i];
+	for (i = 1; i < 4; i++)
+		r[i] += r[0];
+	for (i = 0; i < 4; i++)
+		r[i] = hsh_fmix(r[i]);
+	for (i = 1; i < 4; i++)
+		r[0] += r[i];
+	for (i = 1; i < 4; i++)
+		r[i] += r[0];
+	for (i = 0; i < 4; i++)
+		sprintf(s + i * 8, "%08x", r[i]);
+}
@@ -0,0 +1,35 @@
+/* hash tables for finding names */
+struct tab {
+	int *head;		/* hash table heads */
+	int *next;		/* the next entry in each chain */
+	unsigned *hash;		/* entry hashes */
+	int nhead;		/* number of heads */
+	int n;			/* number of entries */
+	int sz;			/* allocated entries */
+};
+
+void tab_done(struct tab *t);
+int tab_add(struct tab *t, char *key);
+void tab_pop(struct tab *t, int n);
+int tab_find(struct tab *t, char *key);
+int tab_next(struct tab *t, int i);
+int tab_addi(struct tab *t, int key);
+int tab_findi(struct tab *t, int key);
+
+/* interned strings */
+int atom(char *s);
+char *atom_name(int id);
+int atom_count(void);
+void atom_done(void);
+
+/* content hashes */
+struct hsh {
+	unsigned h[4];		/* hash state */
+	unsigned char blk[16];	/* the incomplete block */
+	int nblk;		/* bytes in blk */
+	unsigned len;		/* total length */
+};
+
+void hsh_init(struct hsh *h);
+void hsh_put(struct hsh *h, void *buf, int len);
+void hsh_hex(struct hsh *h, char *s);
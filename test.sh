@@ -0,0 +1,94 @@
+#!/bin/sh
+# neatcc tests: ./test.sh [ncc]
+#
+# Each test generates a program in a temporary directory and runs it
+# with "ncc -r"; main() returns zero on success.
+NCC="${1-./ncc}"
+DIR="$(mktemp -d)"
+trap 'rm -rf "$DIR"' EXIT
+FAIL=0
+
+check() {
+	if "$NCC" -r "$DIR/$1.c"; then
+		echo "$1: ok"
+	else
+		echo "$1: failed"
+		FAIL=1
+	fi
+}
+
+# structs with more fields than fit in an arena block
+test_fields() {
+	awk 'BEGIN {
+		for (s = 0; s < 2; s++) {
+			printf "struct s%d {\n", s
+			for (i = 0; i < 1500; i++)
+				printf "\tint f%d;\n", i
+			printf "};\n"
+		}
+		printf "struct s0 a;\n"
+		printf "int main(void)\n{\n"
+		printf "\tstruct s1 b;\n"
+		printf "\ta.f1499 = 3;\n\tb.f0 = 4;\n\tb.f1499 = 5;\n"
+		printf "\tif (sizeof(a) != 1500 * sizeof(int))\n\t\treturn 1;\n"
+		printf "\treturn a.f1499 + b.f0 + b.f1499 - 12;\n}\n"
+	}' > "$DIR/fields.c"
+	check fields
+}
+
+# libc data and function addresses in programs run with -r
+test_libc() {
+	cat > "$DIR/libc.c" <<EOT
+extern void *stderr;
+extern int errno;
+int fprintf(void *f, char *fmt, ...);
+int atoi(char *s);
+int close(int fd);
+static int (*gp)(char *s) = atoi;
+int main(void)
+{
+	int (*p)(char *s) = atoi;
+	errno = 0;
+	close(-1);
+	if (!errno || fprintf(stderr, ""))
+		return 1;
+	return p("3") + gp("4") - 7;
+}
+EOT
+	check libc
+}
+
+# libncc.a may be linked with programs that use the same names
+test_lib() {
+	cat > "$DIR/lib.c" <<EOT
+#include <err.h>
+#include <stdlib.h>
+#include "libncc.h"
+int cs = 7;
+int mem_len(void)
+{
+	return 0;
+}
+int main(void)
+{
+	char *obj;
+	int len;
+	if (ncc_compile("f.c", "int f(void) { return 1; }", 25,
+			NULL, NULL, &obj, &len))
+		errx(1, "%s", ncc_error());
+	return len <= 0 || cs != 7 || mem_len();
+}
+EOT
+	if ${CC-cc} -I. -o "$DIR/lib" "$DIR/lib.c" libncc.a -ldl &&
+			"$DIR/lib"; then
+		echo "lib: ok"
+	else
+		echo "lib: failed"
+		FAIL=1
+	fi
+}
+
+test_fields
+test_libc
+test_lib
+exit $FAIL
@@ -1,72 +1,124 @@
 /* neatcc tokenizer */
 #include <ctype.h>
 #include <unistd.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "gen.h"
 #include "mem.h"
 #include "ncc.h"
+#include "tab.h"
 #include "tok.h"
 
-static struct mem tok_mem;	/* the data read via cpp_read() so far */
+static struct mem tok_mem;	/* the data read via cpp_read() after tok_base */
+static long tok_base;		/* the address of the first byte of tok_mem */
+static long tok_kept = -1;	/* the text after this address is kept */
 static struct mem str;		/* the last tok_str() string */
 static char *buf;
 static int len;
 static int cur;
 static char name[NAMELEN];
+static int name_id;		/* the atom of the last name */
 static int next = -1;
-static int pre;
+static long pre;		/* the address before the last token */
+
+/* recorded tokens; tok_jump() into them replays instead of lexing again */
+struct tokrec {
+	int tok;		/* token type */
+	long pre;		/* tok_addr() before the token */
+	long end;		/* the address after the token */
+	int val;		/* name atom or string offset in rec_dat */
+	int bt;			/* number type */
+	long num;		/* number value or string length */
+};
+
+static struct mem rec;		/* recorded tokens (struct tokrec) */
+static struct mem rec_dat;	/* strings of recorded tokens */
+static int rec_on;		/* recording tokens */
+static int rec_pos;		/* the next token to replay */
+static struct hsh *tok_h;	/* the hash of the tokens read */
+static long stat_toks;		/* tokens read */
+static long stat_bytes;		/* bytes read via cpp_read() */
+
+/* character classes */
+#define C_SPACE		0x01	/* white space */
+#define C_DIGIT		0x02	/* decimal digit */
+#define C_ID		0x04	/* identifier character */
+#define C_HEX		0x08	/* hexadecimal letter */
+#define C_PUNC		0x10	/* one-character punctuator */
+#define C_EQ		0x20	/* may be followed by '=' as in "+=" */
+#define C_TWICE		0x40	/* may be doubled as in "++" */
+
+#define CLS(c)		(ctab[(unsigned char) (c)])
+
+static unsigned char ctab[256] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x01, 0x30, 0x00, 0x00, 0x00, 0x30, 0x70, 0x00, 0x10, 0x10, 0x30, 0x70, 0x10, 0x70, 0x10, 0x30,
+	0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x10, 0x10, 0x70, 0x30, 0x70, 0x10,
+	0x00, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x10, 0x00, 0x10, 0x30, 0x04,
+	0x00, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x10, 0x70, 0x10, 0x10, 0x00,
+};
+
+/* keywords, indexed by KWHASH(); no two keywords collide */
+#define KWHASH(s, n)	(((s)[0] + (s)[(n) - 1] + (n) * 4) & 0x3f)
 
 static struct {
 	char *name;
 	unsigned id;
-} kwds[] = {
-	{"void", TOK_VOID},
-	{"static", TOK_STATIC},
-	{"extern", TOK_EXTERN},
-	{"return", TOK_RETURN},
-	{"unsigned", TOK_UNSIGNED},
-	{"signed", TOK_SIGNED},
-	{"short", TOK_SHORT},
-	{"long", TOK_LONG},
-	{"int", TOK_INT},
-	{"char", TOK_CHAR},
-	{"struct", TOK_STRUCT},
-	{"union", TOK_UNION},
-	{"enum", TOK_ENUM},
-	{"typedef", TOK_TYPEDEF},
-	{"if", TOK_IF},
-	{"else", TOK_ELSE},
-	{"for", TOK_FOR},
-	{"while", TOK_WHILE},
-	{"do", TOK_DO},
-	{"switch", TOK_SWITCH},
-	{"case", TOK_CASE},
-	{"sizeof", TOK_SIZEOF},
-	{"break", TOK_BREAK},
-	{"continue", TOK_CONTINUE},
-	{"default", TOK_DEFAULT},
-	{"goto", TOK_GOTO},
+} kwds[64] = {
+	[23] = {"if", TOK_IF},
+	[24] = {"case", TOK_CASE},
+	[26] = {"else", TOK_ELSE},
+	[27] = {"do", TOK_DO},
+	[33] = {"break", TOK_BREAK},
+	[34] = {"enum", TOK_ENUM},
+	[35] = {"long", TOK_LONG},
+	[36] = {"for", TOK_FOR},
+	[37] = {"char", TOK_CHAR},
+	[38] = {"goto", TOK_GOTO},
+	[40] = {"continue", TOK_CONTINUE},
+	[41] = {"int", TOK_INT},
+	[42] = {"void", TOK_VOID},
+	[43] = {"extern", TOK_EXTERN},
+	[46] = {"static", TOK_STATIC},
+	[47] = {"signed", TOK_SIGNED},
+	[48] = {"while", TOK_WHILE},
+	[49] = {"sizeof", TOK_SIZEOF},
+	[51] = {"switch", TOK_SWITCH},
+	[52] = {"default", TOK_DEFAULT},
+	[54] = {"typedef", TOK_TYPEDEF},
+	[55] = {"union", TOK_UNION},
+	[56] = {"return", TOK_RETURN},
+	[57] = {"unsigned", TOK_UNSIGNED},
+	[59] = {"short", TOK_SHORT},
+	[63] = {"struct", TOK_STRUCT},
 };
 
-static char *tok3[] = {
-	"<<=", ">>=", "...", "<<", ">>", "++", "--", "+=", "-=", "*=", "/=",
-	"%=", "|=", "&=", "^=", "&&", "||", "==", "!=", "<=", ">=", "->"
-};
-
-static int get_tok3(int num)
+static int kwd_find(char *s, int n)
 {
-	int i;
-	for (i = 0; i < LEN(tok3); i++)
-		if (num == TOK3(tok3[i]))
-			return num;
-	return 0;
+	int h = KWHASH(s, n);
+	if (kwds[h].name && !strcmp(kwds[h].name, s))
+		return kwds[h].id;
+	return TOK_NAME;
 }
 
 static char *esc_code = "abefnrtv";
 static char *esc = "\a\b\e\f\n\r\t\v";
 static char *digs = "0123456789abcdef";
 
+/* the value of a hexadecimal digit or 16 */
+static int digval(int c)
+{
+	if (CLS(c) & C_DIGIT)
+		return c - '0';
+	if (CLS(c) & C_HEX)
+		return (c | 0x20) - 'a' + 10;
+	return 16;
+}
+
 static int esc_char(int *c, char *s)
 {
 	if (*s != '\\') {
@@ -116,14 +168,14 @@ static void readnum(void)
 		base = 16;
 		cur += 2;
 	}
-	if (strchr(digs, tolower(buf[cur]))) {
+	if (digval(buf[cur]) < 16) {
 		long result = 0;
-		char *c;
+		int d;
 		if (base == 10 && buf[cur] == '0')
 			base = 8;
-		while (cur < len && (c = strchr(digs, tolower(buf[cur])))) {
+		while (cur < len && (d = digval(buf[cur])) < 16) {
 			result *= base;
-			result += c - digs;
+			result += d;
 			cur++;
 		}
 		num = result;
@@ -173,9 +225,21 @@ static void readstr(struct mem *mem)
 	cur = s - buf + 1;
 }
 
-static int id_char(int c)
+/* drop the text before cur, except what tok_keep() asked for */
+static void tok_drop(void)
 {
-	return isalnum(c) || c == '_';
+	long keep = tok_base + cur;
+	int n;
+	if (tok_kept >= 0 && tok_kept < keep)
+		keep = tok_kept;
+	n = keep - tok_base;
+	if (n <= 0)
+		return;
+	memmove(buf, buf + n, len - n);
+	mem_cut(&tok_mem, len - n);
+	tok_base += n;
+	cur -= n;
+	len -= n;
 }
 
 static int skipws(void)
@@ -184,15 +248,17 @@ static int skipws(void)
 	char *cbuf;
 	while (1) {
 		if (cur == len) {
+			tok_drop();
 			clen = 0;
 			while (!clen)
 				if (cpp_read(&cbuf, &clen))
 					return 1;
 			mem_put(&tok_mem, cbuf, clen);
+			stat_bytes += clen;
 			buf = mem_buf(&tok_mem);
 			len = mem_len(&tok_mem);
 		}
-		while (cur < len && isspace(buf[cur]))
+		while (cur < len && CLS(buf[cur]) & C_SPACE)
 			cur++;
 		if (cur == len)
 			continue;
@@ -220,15 +286,32 @@ static int skipws(void)
 	return 0;
 }
 
-int tok_get(void)
+/* read a punctuator using the character classes of its characters */
+static int readpunc(void)
 {
-	int num;
-	if (next != -1) {
-		int tok = next;
-		next = -1;
-		return tok;
+	int c = (unsigned char) buf[cur];
+	int d = (unsigned char) buf[cur + 1];
+	if (c == '.' && d == '.' && buf[cur + 2] == '.') {
+		cur += 3;
+		return TOK3("...");
+	}
+	if ((c == '<' || c == '>') && d == c && buf[cur + 2] == '=') {
+		cur += 3;
+		return TOK3(buf + cur - 3);
+	}
+	if ((d == '=' && CLS(c) & C_EQ) || (d == c && CLS(c) & C_TWICE) ||
+			(c == '-' && d == '>')) {
+		cur += 2;
+		return TOK2(buf + cur - 2);
 	}
-	pre = cur;
+	if (CLS(c) & C_PUNC)
+		return buf[cur++];
+	return -1;
+}
+
+static int tok_read(void)
+{
+	pre = tok_base + cur;
 	if (skipws())
 		return TOK_EOF;
 	if (buf[cur] == '"') {
@@ -240,34 +323,137 @@ int tok_get(void)
 		}
 		return TOK_STR;
 	}
-	if (isdigit(buf[cur]) || buf[cur] == '\'') {
+	if (CLS(buf[cur]) & C_DIGIT || buf[cur] == '\'') {
 		readnum();
 		return TOK_NUM;
 	}
-	if (id_char(buf[cur])) {
+	if (CLS(buf[cur]) & C_ID) {
 		char *s = name;
-		int i;
-		while (cur < len && id_char(buf[cur]))
+		int tok;
+		while (cur < len && CLS(buf[cur]) & C_ID)
 			*s++ = buf[cur++];
 		*s = '\0';
-		for (i = 0; i < LEN(kwds); i++)
-			if (!strcmp(kwds[i].name, name))
-				return kwds[i].id;
-		return TOK_NAME;
+		tok = kwd_find(name, s - name);
+		if (tok == TOK_NAME)
+			name_id = atom(name);
+		return tok;
 	}
-	if (cur + 3 <= len && (num = get_tok3(TOK3(buf + cur)))) {
-		cur += 3;
-		return num;
+	return readpunc();
+}
+
+static int rec_cnt(void)
+{
+	return mem_len(&rec) / sizeof(struct tokrec);
+}
+
+static void rec_add(int tok)
+{
+	struct tokrec r = {tok, pre, tok_base + cur};
+	if (tok == TOK_NAME)
+		r.val = name_id;
+	if (tok == TOK_STR) {
+		r.val = mem_len(&rec_dat);
+		r.num = mem_len(&str);
+		mem_put(&rec_dat, mem_buf(&str), mem_len(&str));
 	}
-	if ((num = get_tok3(TOK2(buf + cur)))) {
-		cur += 2;
-		return num;
+	if (tok == TOK_NUM) {
+		r.num = num;
+		r.bt = num_bt;
+	}
+	mem_put(&rec, &r, sizeof(r));
+	rec_pos = rec_cnt();
+}
+
+static int rec_get(void)
+{
+	struct tokrec *r = (struct tokrec *) mem_buf(&rec) + rec_pos++;
+	char *dat = mem_buf(&rec_dat);
+	pre = r->pre;
+	cur = r->end - tok_base;
+	if (r->tok == TOK_NAME)
+		name_id = r->val;
+	if (r->tok == TOK_STR) {
+		mem_cut(&str, 0);
+		mem_put(&str, dat + r->val, r->num);
+	}
+	if (r->tok == TOK_NUM) {
+		num = r->num;
+		num_bt = r->bt;
+	}
+	return r->tok;
+}
+
+/* find the recorded token starting at addr or return -1 */
+static int rec_find(long addr)
+{
+	struct tokrec *r = mem_buf(&rec);
+	int l = 0;
+	int h = rec_cnt();
+	while (l < h) {
+		int m = (l + h) >> 1;
+		if (r[m].pre == addr)
+			return m;
+		if (r[m].pre < addr)
+			l = m + 1;
+		else
+			h = m;
 	}
-	if (strchr(";,{}()[]<>*&!=+-/%?:|^~.", buf[cur]))
-		return buf[cur++];
 	return -1;
 }
 
+/* add the last token to tok_h */
+static void tok_hput(int tok)
+{
+	hsh_put(tok_h, &tok, sizeof(tok));
+	if (tok == TOK_NAME)
+		hsh_put(tok_h, name, strlen(name) + 1);
+	if (tok == TOK_NUM) {
+		hsh_put(tok_h, &num, sizeof(num));
+		hsh_put(tok_h, &num_bt, sizeof(num_bt));
+	}
+	if (tok == TOK_STR) {
+		int n = mem_len(&str);
+		hsh_put(tok_h, &n, sizeof(n));
+		hsh_put(tok_h, mem_buf(&str), n);
+	}
+}
+
+int tok_get(void)
+{
+	int tok;
+	if (next != -1) {
+		tok = next;
+		next = -1;
+		return tok;
+	}
+	if (rec_pos < rec_cnt())
+		return rec_get();
+	tok = tok_read();
+	stat_toks++;
+	if (rec_on && tok != TOK_EOF)
+		rec_add(tok);
+	if (tok_h)
+		tok_hput(tok);
+	return tok;
+}
+
+/* hash the tokens read from now on into h; replayed tokens are not hashed */
+void tok_hsh(struct hsh *h)
+{
+	tok_h = h;
+}
+
+/* start (on is nonzero) or stop recording tokens for tok_jump() */
+void tok_rec(int on)
+{
+	mem_cut(&rec, 0);
+	mem_cut(&rec_dat, 0);
+	rec_pos = 0;
+	rec_on = on;
+	if (on && next != -1 && next != TOK_EOF)
+		rec_add(next);
+}
+
 int tok_see(void)
 {
 	if (next == -1)
@@ -275,19 +461,76 @@ int tok_see(void)
 	return next;
 }
 
-char *tok_id(void)
+/* the atom of the last name */
+int tok_id(void)
 {
-	return name;
+	return name_id;
 }
 
 long tok_addr(void)
 {
-	return next == -1 ? cur : pre;
+	return next == -1 ? tok_base + cur : pre;
+}
+
+/* keep the text after addr for tok_jump(); cpp_read() output is dropped otherwise */
+void tok_keep(long addr)
+{
+	tok_kept = addr;
 }
 
 void tok_jump(long addr)
 {
-	cur = addr;
-	pre = cur - 1;
+	if (rec_on) {
+		struct tokrec *r = mem_buf(&rec);
+		int n = rec_cnt();
+		rec_pos = rec_find(addr);
+		if (rec_pos < 0 && n && r[n - 1].end == addr)
+			rec_pos = n;
+		if (rec_pos < 0) {	/* outside the recorded tokens */
+			mem_cut(&rec, 0);
+			mem_cut(&rec_dat, 0);
+			rec_pos = 0;
+		}
+	}
+	/* the dropped text between addr and tok_base is white space */
+	cur = addr > tok_base ? addr - tok_base : 0;
+	pre = addr - 1;
+	next = -1;
+	tok_kept = -1;
+}
+
+/* report the tokens read in us microseconds on stderr */
+void tok_stats(long us)
+{
+	char msg[256];
+	sprintf(msg, "tokens: %ld read from %ld KB in %ldus, %ld tokens/s, %ld MB/s\n",
+		stat_toks, stat_bytes >> 10, us,
+		us > 0 ? stat_toks * 1000 / us * 1000 : 0,
+		us > 0 ? stat_bytes / us : 0);
+	write(2, msg, strlen(msg));
+}
+
+void tok_resetstats(void)
+{
+	stat_toks = 0;
+	stat_bytes = 0;
+}
+
+/* release the state of the tokenizer */
+void tok_done(void)
+{
+	mem_done(&tok_mem);
+	mem_done(&str);
+	mem_done(&rec);
+	mem_done(&rec_dat);
+	tok_base = 0;
+	tok_kept = -1;
+	buf = NULL;
+	len = 0;
+	cur = 0;
 	next = -1;
+	pre = 0;
+	rec_on = 0;
+	rec_pos = 0;
+	tok_h = NULL;
 }
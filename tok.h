@@ -38,17 +38,35 @@ enum tok {
 void tok_init(char *path);
 int tok_see(void);
 int tok_get(void);
-char *tok_id(void);
+int tok_id(void);
 int tok_num(long *n);
 void tok_str(char **buf, int *len);
 long tok_addr(void);
 void tok_jump(long addr);
+void tok_keep(long addr);
+void tok_rec(int on);
+struct hsh;
+void tok_hsh(struct hsh *h);
+void tok_done(void);
+void tok_stats(long us);
+void tok_resetstats(void);
+
+struct mem;
 
 int cpp_init(char *path);
+int cpp_initbuf(char *path, char *dat, int dlen);
+void cpp_reset(void);
+void cpp_done(void);
+void cpp_renew(char *cwd);
 void cpp_addpath(char *s);
 void cpp_define(char *name, char *def);
 char *cpp_loc(long addr);
 int cpp_read(char **buf, int *len);
+void cpp_all(char **out, int *len);
+void cpp_pchsave(struct mem *mem);
+char *cpp_pchload(char *s);
+void cpp_stats(void);
 
+extern void (*die_hook)(char *msg);
 void die(char *msg, ...);
 void err(char *fmt, ...);
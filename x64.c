@@ -294,13 +294,14 @@ static void i_shl_imm(int op, int rd, int rn, long n)
 
 void i_sym(int rd, char *sym, int off)
 {
-	int sz = X64_ABS_RL & OUT_RL32 ? 4 : LONGSZ;
-	if (X64_ABS_RL & OUT_RLSX)
+	int rl = farsym ? 0 : X64_ABS_RL;	/* movabs for far symbols */
+	int sz = rl & OUT_RL32 ? 4 : LONGSZ;
+	if (rl & OUT_RLSX)
 		op_rr(I_MOVI, 0, rd, sz);
 	else
 		op_x(I_MOVIR + (rd & 7), 0, rd, sz);
 	if (!pass1)
-		out_rel(sym, OUT_CS | X64_ABS_RL, cslen);
+		out_rel(sym, OUT_CS | rl, cslen);
 	oi(off, sz);
 }
 